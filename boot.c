@@ -0,0 +1,170 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/stat.h>
+
+#include "gameboy.h"
+
+#include "cpu.h"
+#include "hash.h"
+#include "memory.h"
+#include "state.h"
+#include "timer.h"
+#include "video.h"
+
+/* The first instruction of the cartridge */
+#define ENTRY 0x100
+
+/*
+ * Post-boot state cache. The state at the end of the boot ROM only
+ * depends on the boot ROM and the cartridge, so it is written to a state
+ * file in the cache directory named after both the first time the boot
+ * ROM runs, and later runs start from it right away. The name also holds
+ * the hash of the tmpgb binary, so a new build boots again instead of
+ * starting from a state the old one left behind. Only a boot that ran
+ * from power on to the boot ROM unmapping itself is cached, not one that
+ * a loaded state took over.
+ */
+static int waiting;
+static const u16 *pc;
+
+static int make_dir(const char *path)
+{
+	return mkdir(path, 0755) == 0 || errno == EEXIST ? 0 : -1;
+}
+
+/* Returns -1 if the binary can't be read */
+static int build_hash(u64 *hash)
+{
+	static u64 h;
+	static int done;
+	static u8 buf[0x10000];
+	size_t n;
+	FILE *fp;
+
+	if (!done) {
+		fp = fopen("/proc/self/exe", "rb");
+		if (!fp)
+			return -1;
+		while ((n = fread(buf, 1, sizeof(buf), fp)) > 0)
+			h = hash64(buf, n, h);
+		if (ferror(fp)) {
+			fclose(fp);
+			return -1;
+		}
+		fclose(fp);
+		done = 1;
+	}
+	*hash = h;
+	return 0;
+}
+
+/* $XDG_CACHE_HOME/tmpgb or ~/.cache/tmpgb, created if missing */
+static int cache_path(char *path, size_t n)
+{
+	const char *base = getenv("XDG_CACHE_HOME");
+	const char *home = getenv("HOME");
+	u64 build;
+	int len;
+
+	if (build_hash(&build) != 0)
+		return -1;
+	if (base && *base) {
+		len = snprintf(path, n, "%s/tmpgb", base);
+	} else if (home && *home) {
+		len = snprintf(path, n, "%s/.cache", home);
+		if (len < 0 || (size_t) len >= n || make_dir(path) != 0)
+			return -1;
+		len = snprintf(path, n, "%s/.cache/tmpgb", home);
+	} else {
+		return -1;
+	}
+	if (len < 0 || (size_t) len >= n || make_dir(path) != 0)
+		return -1;
+
+	len += snprintf(path + len, n - len, "/%016llx-%016llx-%016llx.state",
+			(unsigned long long) bootrom_hash(),
+			(unsigned long long) rom_hash(),
+			(unsigned long long) build);
+	return (size_t) len < n ? 0 : -1;
+}
+
+/* Returns 1 if the machine now starts at the cartridge's entry point */
+int load_boot_cache(void)
+{
+	char path[4096];
+	struct state_file *f;
+
+	if (cache_path(path, sizeof(path)) != 0)
+		return 0;
+	f = open_state_file(path);
+	if (!f)
+		return 0;
+	load_state_file(f);
+	close_state_file(f);
+	return 1;
+}
+
+static void save_boot_cache(void)
+{
+	char path[4096];
+
+	if (cache_path(path, sizeof(path)) != 0 ||
+	    write_state_file(path) != 0)
+		errorf("could not cache the state after the boot ROM");
+}
+
+static void find_pc(void)
+{
+	struct cpu_info cpu;
+
+	cpu_debug_info(&cpu);
+	pc = cpu.PC;
+}
+
+/* Run the boot ROM on this thread as fast as possible without drawing */
+void run_boot(void)
+{
+	pause_rendering(1);
+	while (bootrom_mapped()) {
+		update_timer();
+		draw();
+		fetch_opcode();
+	}
+	pause_rendering(0);
+}
+
+/* Run the boot ROM as above and cache the state it leaves behind */
+void turbo_boot(void)
+{
+	find_pc();
+	run_boot();
+	if (*pc == ENTRY)
+		save_boot_cache();
+}
+
+/* Cache the state once the boot ROM running normally is done */
+void wait_for_boot(void)
+{
+	find_pc();
+	waiting = 1;
+}
+
+/* Called before every instruction */
+void boot_step(void)
+{
+	if (!waiting || bootrom_mapped())
+		return;
+	/* The boot ROM just handed over */
+	waiting = 0;
+	if (*pc == ENTRY)
+		save_boot_cache();
+}
+
+/* The machine was replaced by a loaded state, its boot is not ours */
+void cancel_boot_cache(void)
+{
+	waiting = 0;
+}
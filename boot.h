@@ -0,0 +1,14 @@
+#ifndef BOOT_H
+#define BOOT_H
+int load_boot_cache(void);
+
+void run_boot(void);
+
+void turbo_boot(void);
+
+void wait_for_boot(void);
+
+void boot_step(void);
+
+void cancel_boot_cache(void);
+#endif
@@ -0,0 +1,336 @@
+#include <string.h>
+
+#include "gameboy.h"
+
+#include "compose.h"
+#include "video.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#define HAVE_X86_SIMD
+#include <immintrin.h>
+#endif
+
+/*
+ * Line compositing kernels. Every kernel has a scalar version and, on x86,
+ * SSSE3 and AVX2 versions that are picked at runtime by init_compose().
+ *
+ * expand_tile: 16 bytes of 2bpp tile data to 64 color numbers, both as
+ * stored and flipped horizontally.
+ * compose_line: merge a background and a sprite line into shades,
+ * applying palettes, sprite transparency and OBJ-to-BG priority.
+ * shade_to_rgba: map shades to 32 bit host pixels.
+ */
+struct compose_impl {
+	const char *name;
+	void (*expand_tile)(const u8 *, u8 *, u8 *);
+	void (*compose_line)(u8 *, const u8 *, const u8 *, const u8 *,
+			     const u8 *, const u8 *);
+	void (*shade_to_rgba)(u32 *, const u8 *, const u32 *, int);
+};
+
+static void expand_tile_scalar(const u8 *data, u8 *pixels, u8 *flipped)
+{
+	int x, y;
+	u8 color;
+
+	for (y = 0; y < 8; y++) {
+		for (x = 0; x < 8; x++) {
+			color = ((data[2 * y] >> (7 - x)) & 0x1) +
+				(((data[2 * y + 1] >> (7 - x)) & 0x1) << 1);
+			pixels[8 * y + x] = color;
+			flipped[8 * y + 7 - x] = color;
+		}
+	}
+}
+
+static void compose_line_scalar(u8 *dst, const u8 *bg, const u8 *obj_color,
+				const u8 *obj_flags, const u8 *bgp,
+				const u8 *obp)
+{
+	int i;
+
+	for (i = 0; i < WIDTH; i++) {
+		if (obj_color[i] &&
+		    !((obj_flags[i] & OBJ_BG_PRIORITY) && bg[i])) {
+			if (obj_flags[i] & PALETTENR)
+				dst[i] = obp[4 + obj_color[i]];
+			else
+				dst[i] = obp[obj_color[i]];
+		} else {
+			dst[i] = bgp[bg[i]];
+		}
+	}
+}
+
+static void shade_to_rgba_scalar(u32 *dst, const u8 *src, const u32 *palette,
+				 int n)
+{
+	int i;
+
+	for (i = 0; i < n; i++)
+		dst[i] = palette[src[i]];
+}
+
+static const struct compose_impl scalar_impl = {
+	"scalar",
+	expand_tile_scalar,
+	compose_line_scalar,
+	shade_to_rgba_scalar
+};
+
+static const struct compose_impl *impl = &scalar_impl;
+
+#ifdef HAVE_X86_SIMD
+#define SSSE3 __attribute__((target("ssse3")))
+#define AVX2 __attribute__((target("avx2")))
+
+/* Two rows per register: each lsb/msb byte is spread over 8 lanes and
+ * tested against a single bit per lane. */
+SSSE3 static void expand_tile_ssse3(const u8 *data, u8 *pixels, u8 *flipped)
+{
+	__m128i tile = _mm_loadu_si128((const __m128i *) data);
+	__m128i bits = _mm_setr_epi8((char) 0x80, 0x40, 0x20, 0x10, 8, 4, 2, 1,
+				     (char) 0x80, 0x40, 0x20, 0x10, 8, 4, 2, 1);
+	__m128i rbits = _mm_setr_epi8(1, 2, 4, 8, 0x10, 0x20, 0x40, (char) 0x80,
+				      1, 2, 4, 8, 0x10, 0x20, 0x40, (char) 0x80);
+	__m128i lo_idx = _mm_setr_epi8(0, 0, 0, 0, 0, 0, 0, 0,
+				       2, 2, 2, 2, 2, 2, 2, 2);
+	__m128i one = _mm_set1_epi8(1);
+	__m128i two = _mm_set1_epi8(2);
+	__m128i step = _mm_set1_epi8(4);
+	__m128i hi_idx = _mm_add_epi8(lo_idx, one);
+	__m128i lsb, msb, px;
+	int i;
+
+	for (i = 0; i < 4; i++) {
+		lsb = _mm_shuffle_epi8(tile, lo_idx);
+		msb = _mm_shuffle_epi8(tile, hi_idx);
+
+		px = _mm_or_si128(
+			_mm_and_si128(_mm_cmpeq_epi8(_mm_and_si128(lsb, bits), bits), one),
+			_mm_and_si128(_mm_cmpeq_epi8(_mm_and_si128(msb, bits), bits), two));
+		_mm_storeu_si128((__m128i *) (pixels + 16 * i), px);
+
+		px = _mm_or_si128(
+			_mm_and_si128(_mm_cmpeq_epi8(_mm_and_si128(lsb, rbits), rbits), one),
+			_mm_and_si128(_mm_cmpeq_epi8(_mm_and_si128(msb, rbits), rbits), two));
+		_mm_storeu_si128((__m128i *) (flipped + 16 * i), px);
+
+		lo_idx = _mm_add_epi8(lo_idx, step);
+		hi_idx = _mm_add_epi8(hi_idx, step);
+	}
+}
+
+SSSE3 static void compose_line_ssse3(u8 *dst, const u8 *bg, const u8 *obj_color,
+				     const u8 *obj_flags, const u8 *bgp,
+				     const u8 *obp)
+{
+	u8 bgtab[16] = { 0 };
+	u8 objtab[16] = { 0 };
+	__m128i bgv, objv, b, oc, of, bgs, objs, hide;
+	__m128i zero = _mm_setzero_si128();
+	__m128i prio = _mm_set1_epi8((char) OBJ_BG_PRIORITY);
+	__m128i palnr = _mm_set1_epi8(PALETTENR);
+	int i;
+
+	memcpy(bgtab, bgp, 4);
+	memcpy(objtab, obp, 8);
+	bgv = _mm_loadu_si128((const __m128i *) bgtab);
+	objv = _mm_loadu_si128((const __m128i *) objtab);
+
+	for (i = 0; i < WIDTH; i += 16) {
+		b = _mm_loadu_si128((const __m128i *) (bg + i));
+		oc = _mm_loadu_si128((const __m128i *) (obj_color + i));
+		of = _mm_loadu_si128((const __m128i *) (obj_flags + i));
+
+		bgs = _mm_shuffle_epi8(bgv, b);
+		objs = _mm_shuffle_epi8(objv, _mm_or_si128(oc,
+			_mm_srli_epi16(_mm_and_si128(of, palnr), 2)));
+		hide = _mm_or_si128(_mm_cmpeq_epi8(oc, zero),
+			_mm_andnot_si128(_mm_cmpeq_epi8(b, zero),
+				_mm_cmpeq_epi8(_mm_and_si128(of, prio), prio)));
+
+		_mm_storeu_si128((__m128i *) (dst + i),
+			_mm_or_si128(_mm_and_si128(hide, bgs),
+				     _mm_andnot_si128(hide, objs)));
+	}
+}
+
+/* Shades are scaled to byte offsets into the palette register and spread
+ * over the 4 bytes of each output pixel. */
+SSSE3 static void shade_to_rgba_ssse3(u32 *dst, const u8 *src,
+				      const u32 *palette, int n)
+{
+	__m128i pal = _mm_loadu_si128((const __m128i *) palette);
+	__m128i offs = _mm_setr_epi8(0, 1, 2, 3, 0, 1, 2, 3,
+				     0, 1, 2, 3, 0, 1, 2, 3);
+	__m128i spread = _mm_setr_epi8(0, 0, 0, 0, 1, 1, 1, 1,
+				       2, 2, 2, 2, 3, 3, 3, 3);
+	__m128i four = _mm_set1_epi8(4);
+	__m128i s, idx;
+	int i, k;
+
+	for (i = 0; i + 16 <= n; i += 16) {
+		s = _mm_slli_epi16(_mm_loadu_si128((const __m128i *) (src + i)), 2);
+		idx = spread;
+		for (k = 0; k < 4; k++) {
+			_mm_storeu_si128((__m128i *) (dst + i + 4 * k),
+				_mm_shuffle_epi8(pal, _mm_add_epi8(
+					_mm_shuffle_epi8(s, idx), offs)));
+			idx = _mm_add_epi8(idx, four);
+		}
+	}
+	shade_to_rgba_scalar(dst + i, src + i, palette, n - i);
+}
+
+static const struct compose_impl ssse3_impl = {
+	"ssse3",
+	expand_tile_ssse3,
+	compose_line_ssse3,
+	shade_to_rgba_ssse3
+};
+
+/* Four rows per register, the tile is copied to both 128 bit lanes. */
+AVX2 static void expand_tile_avx2(const u8 *data, u8 *pixels, u8 *flipped)
+{
+	__m256i tile = _mm256_broadcastsi128_si256(
+		_mm_loadu_si128((const __m128i *) data));
+	__m256i bits = _mm256_setr_epi8(
+		(char) 0x80, 0x40, 0x20, 0x10, 8, 4, 2, 1,
+		(char) 0x80, 0x40, 0x20, 0x10, 8, 4, 2, 1,
+		(char) 0x80, 0x40, 0x20, 0x10, 8, 4, 2, 1,
+		(char) 0x80, 0x40, 0x20, 0x10, 8, 4, 2, 1);
+	__m256i rbits = _mm256_setr_epi8(
+		1, 2, 4, 8, 0x10, 0x20, 0x40, (char) 0x80,
+		1, 2, 4, 8, 0x10, 0x20, 0x40, (char) 0x80,
+		1, 2, 4, 8, 0x10, 0x20, 0x40, (char) 0x80,
+		1, 2, 4, 8, 0x10, 0x20, 0x40, (char) 0x80);
+	__m256i lo_idx = _mm256_setr_epi8(
+		0, 0, 0, 0, 0, 0, 0, 0, 2, 2, 2, 2, 2, 2, 2, 2,
+		4, 4, 4, 4, 4, 4, 4, 4, 6, 6, 6, 6, 6, 6, 6, 6);
+	__m256i one = _mm256_set1_epi8(1);
+	__m256i two = _mm256_set1_epi8(2);
+	__m256i step = _mm256_set1_epi8(8);
+	__m256i hi_idx = _mm256_add_epi8(lo_idx, one);
+	__m256i lsb, msb, px;
+	int i;
+
+	for (i = 0; i < 2; i++) {
+		lsb = _mm256_shuffle_epi8(tile, lo_idx);
+		msb = _mm256_shuffle_epi8(tile, hi_idx);
+
+		px = _mm256_or_si256(
+			_mm256_and_si256(_mm256_cmpeq_epi8(_mm256_and_si256(lsb, bits), bits), one),
+			_mm256_and_si256(_mm256_cmpeq_epi8(_mm256_and_si256(msb, bits), bits), two));
+		_mm256_storeu_si256((__m256i *) (pixels + 32 * i), px);
+
+		px = _mm256_or_si256(
+			_mm256_and_si256(_mm256_cmpeq_epi8(_mm256_and_si256(lsb, rbits), rbits), one),
+			_mm256_and_si256(_mm256_cmpeq_epi8(_mm256_and_si256(msb, rbits), rbits), two));
+		_mm256_storeu_si256((__m256i *) (flipped + 32 * i), px);
+
+		lo_idx = _mm256_add_epi8(lo_idx, step);
+		hi_idx = _mm256_add_epi8(hi_idx, step);
+	}
+}
+
+AVX2 static void compose_line_avx2(u8 *dst, const u8 *bg, const u8 *obj_color,
+				   const u8 *obj_flags, const u8 *bgp,
+				   const u8 *obp)
+{
+	u8 bgtab[16] = { 0 };
+	u8 objtab[16] = { 0 };
+	__m256i bgv, objv, b, oc, of, bgs, objs, hide;
+	__m256i zero = _mm256_setzero_si256();
+	__m256i prio = _mm256_set1_epi8((char) OBJ_BG_PRIORITY);
+	__m256i palnr = _mm256_set1_epi8(PALETTENR);
+	int i;
+
+	memcpy(bgtab, bgp, 4);
+	memcpy(objtab, obp, 8);
+	bgv = _mm256_broadcastsi128_si256(
+		_mm_loadu_si128((const __m128i *) bgtab));
+	objv = _mm256_broadcastsi128_si256(
+		_mm_loadu_si128((const __m128i *) objtab));
+
+	for (i = 0; i < WIDTH; i += 32) {
+		b = _mm256_loadu_si256((const __m256i *) (bg + i));
+		oc = _mm256_loadu_si256((const __m256i *) (obj_color + i));
+		of = _mm256_loadu_si256((const __m256i *) (obj_flags + i));
+
+		bgs = _mm256_shuffle_epi8(bgv, b);
+		objs = _mm256_shuffle_epi8(objv, _mm256_or_si256(oc,
+			_mm256_srli_epi16(_mm256_and_si256(of, palnr), 2)));
+		hide = _mm256_or_si256(_mm256_cmpeq_epi8(oc, zero),
+			_mm256_andnot_si256(_mm256_cmpeq_epi8(b, zero),
+				_mm256_cmpeq_epi8(_mm256_and_si256(of, prio), prio)));
+
+		_mm256_storeu_si256((__m256i *) (dst + i),
+			_mm256_or_si256(_mm256_and_si256(hide, bgs),
+					_mm256_andnot_si256(hide, objs)));
+	}
+}
+
+AVX2 static void shade_to_rgba_avx2(u32 *dst, const u8 *src,
+				    const u32 *palette, int n)
+{
+	__m256i pal = _mm256_broadcastsi128_si256(
+		_mm_loadu_si128((const __m128i *) palette));
+	__m256i offs = _mm256_setr_epi8(
+		0, 1, 2, 3, 0, 1, 2, 3, 0, 1, 2, 3, 0, 1, 2, 3,
+		0, 1, 2, 3, 0, 1, 2, 3, 0, 1, 2, 3, 0, 1, 2, 3);
+	__m256i spread = _mm256_setr_epi8(
+		0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2, 3, 3, 3, 3,
+		4, 4, 4, 4, 5, 5, 5, 5, 6, 6, 6, 6, 7, 7, 7, 7);
+	__m256i s;
+	int i;
+
+	for (i = 0; i + 8 <= n; i += 8) {
+		s = _mm256_broadcastsi128_si256(_mm_slli_epi16(
+			_mm_loadl_epi64((const __m128i *) (src + i)), 2));
+		_mm256_storeu_si256((__m256i *) (dst + i),
+			_mm256_shuffle_epi8(pal, _mm256_add_epi8(
+				_mm256_shuffle_epi8(s, spread), offs)));
+	}
+	shade_to_rgba_scalar(dst + i, src + i, palette, n - i);
+}
+
+static const struct compose_impl avx2_impl = {
+	"avx2",
+	expand_tile_avx2,
+	compose_line_avx2,
+	shade_to_rgba_avx2
+};
+#endif
+
+void init_compose(void)
+{
+#ifdef HAVE_X86_SIMD
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2"))
+		impl = &avx2_impl;
+	else if (__builtin_cpu_supports("ssse3"))
+		impl = &ssse3_impl;
+#endif
+}
+
+const char *compose_name(void)
+{
+	return impl->name;
+}
+
+void expand_tile(const u8 *data, u8 *pixels, u8 *flipped)
+{
+	impl->expand_tile(data, pixels, flipped);
+}
+
+void compose_line(u8 *dst, const u8 *bg, const u8 *obj_color,
+		  const u8 *obj_flags, const u8 *bgp, const u8 *obp)
+{
+	impl->compose_line(dst, bg, obj_color, obj_flags, bgp, obp);
+}
+
+void shade_to_rgba(u32 *dst, const u8 *src, const u32 *palette, int n)
+{
+	impl->shade_to_rgba(dst, src, palette, n);
+}
@@ -0,0 +1,13 @@
+#ifndef COMPOSE_H
+#define COMPOSE_H
+void init_compose(void);
+
+const char *compose_name(void);
+
+void expand_tile(const u8 *data, u8 *pixels, u8 *flipped);
+
+void compose_line(u8 *dst, const u8 *bg, const u8 *obj_color,
+		  const u8 *obj_flags, const u8 *bgp, const u8 *obp);
+
+void shade_to_rgba(u32 *dst, const u8 *src, const u32 *palette, int n);
+#endif
@@ -1,5 +1,6 @@
 #include "gameboy.h"
 
+#include "cpu.h"
 #include "interrupt.h"
 #include "memory.h"
 
@@ -28,6 +29,8 @@ static u16 SP;
 
 static int clock_count = 0;
 static int old_clock_count = 0;
+/* Cycles before the current clock_count, which wraps every 1024 */
+static u64 elapsed = 0;
 
 static u64 instruction_count = 0;
 
@@ -49,10 +52,17 @@ int old_cpu_cycle(void)
 	return old_clock_count;
 }
 
+/* Cycles since the machine was started */
+u64 elapsed_cycles(void)
+{
+	return elapsed + clock_count;
+}
+
 static void reset_clock_count(void)
 {
 	clock_count -= 1024;
 	old_clock_count -= 1024;
+	elapsed += 1024;
 }
 
 static void cpu_write_mem(u16 addr, u8 val)
@@ -4548,3 +4558,23 @@ static void init_cb_optable(void)
 	cb_optable[0xFE] = CB_op0xFE;
 	cb_optable[0xFF] = CB_op0xFF;
 }
+
+void cpu_state(struct state *s)
+{
+	STATE(s, A);
+	STATE(s, F);
+	STATE(s, B);
+	STATE(s, C);
+	STATE(s, D);
+	STATE(s, E);
+	STATE(s, H);
+	STATE(s, L);
+	STATE(s, SP);
+	STATE(s, PC);
+	STATE(s, clock_count);
+	STATE(s, old_clock_count);
+	STATE(s, elapsed);
+	STATE(s, instruction_count);
+	STATE(s, ime_scheduled);
+	STATE(s, stopped);
+}
@@ -1,4 +1,6 @@
 void fetch_opcode(void);
 int cpu_cycle(void);
 int old_cpu_cycle(void);
+u64 elapsed_cycles(void);
 void init_cpu(void);
+void cpu_state(struct state *s);
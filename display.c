@@ -3,14 +3,37 @@
 
 #include "gameboy.h"
 
+#include "compose.h"
+#include "emu.h"
 #include "error.h"
-#include "debug.h"
 #include "memory.h"
+#include "movie.h"
+#include "record.h"
+#include "rewind.h"
+#include "runahead.h"
+#include "scale.h"
 #include "video.h"
+#include "worker.h"
 
 static SDL_Window *window;
 static SDL_Renderer *renderer;
-static int palette[4] = { 0xCCCCCC, 0xB2B2B2, 0x666666, 0x191919 };
+static SDL_Texture *texture;
+static u32 palette[4] = { 0xFFCCCCCC, 0xFFB2B2B2, 0xFF666666, 0xFF191919 };
+static u32 pixels[WIDTH * HEIGHT];
+static int lcd_off;
+static u8 buttons;
+static int vsync;
+static int hidden;
+
+/*
+ * Frames are scaled in software to 'scale' times their size and the
+ * result is fitted into the window, either at the largest integer
+ * multiple or, with 'aspect' set, as large as the aspect ratio allows.
+ */
+static int scale = 1;
+static enum scale_filter filter;
+static int aspect;
+static u32 scaled[MAX_SCALE * WIDTH * MAX_SCALE * HEIGHT];
 
 static void clear(void)
 {
@@ -18,6 +41,18 @@ static void clear(void)
 	SDL_RenderClear(renderer);
 }
 
+void enable_vsync(void)
+{
+	vsync = 1;
+}
+
+void set_display_scale(int factor, int f, int keep_aspect)
+{
+	scale = factor;
+	filter = f;
+	aspect = keep_aspect;
+}
+
 int init_sdl(void)
 {
 	int ret = 0;
@@ -26,29 +61,33 @@ int init_sdl(void)
 		ret = -1;
 		goto out;
 	}
-	window = SDL_CreateWindow("tmpgb", 600, 400, WIDTH, HEIGHT, SDL_WINDOW_SHOWN);
+	init_scale();
+	window = SDL_CreateWindow("tmpgb", 600, 400, WIDTH * scale,
+				  HEIGHT * scale,
+				  SDL_WINDOW_SHOWN | SDL_WINDOW_RESIZABLE);
 	if (!window) {
 		ret = -1;
 		goto out;
 	}
-	renderer = SDL_CreateRenderer(window, -1, SDL_RENDERER_ACCELERATED);
+	renderer = SDL_CreateRenderer(window, -1, SDL_RENDERER_ACCELERATED |
+				      (vsync ? SDL_RENDERER_PRESENTVSYNC : 0));
 	if (!renderer) {
 		ret = -1;
 		goto out;
 	}
+	texture = SDL_CreateTexture(renderer, SDL_PIXELFORMAT_ARGB8888,
+				    SDL_TEXTUREACCESS_STREAMING, WIDTH * scale,
+				    HEIGHT * scale);
+	if (!texture) {
+		ret = -1;
+		goto out;
+	}
 out:
 	if (ret == -1)
 		errorf(SDL_GetError());
 	return ret;
 }
 
-static void convert_palette(int *rgb, int hex)
-{
-	rgb[0] = hex >> 16 & 0xFF;
-	rgb[1] = (hex >> 8) & 0xFF;
-	rgb[2] = hex & 0xFF;
-}
-
 /* Disable display */
 void draw_background(void)
 {
@@ -56,31 +95,94 @@ void draw_background(void)
 	SDL_RenderPresent(renderer);
 }
 
+/* Runs on the emulation thread and hands finished frames to the main thread */
 void update_screen(void)
 {
-	u8 line[WIDTH];
-	int i;
-	int color[3];
-	u8 ly = read_memory(0xFF44);
 	int ret;
 
-	if ((ret = draw(line)) == LCD_OFF) {
-		draw_background();
+	if ((ret = draw()) == LCD_OFF) {
+		if (!lcd_off)
+			publish_frame(NULL);
+		lcd_off = 1;
+		return;
+	}
+	lcd_off = 0;
+	if (ret & LCD_VBLANK) {
+		rewind_frame();
+		movie_frame();
+	}
+	if (!(ret & LCD_FRAME))
+		return;
+
+	/* The render thread records its frames itself, get_frame() lags */
+	if (!render_thread_running())
+		record_frame(get_frame());
+	if (run_ahead_enabled()) {
+		publish_frame(run_ahead());
+		return;
+	}
+	if (ret & LCD_UNCHANGED)
+		return;
+
+	publish_frame(get_frame());
+}
+
+static void fit_rect(SDL_Rect *r)
+{
+	int w, h, m;
+
+	SDL_GetRendererOutputSize(renderer, &w, &h);
+	if (aspect) {
+		if (w * HEIGHT > h * WIDTH) {
+			r->h = h;
+			r->w = h * WIDTH / HEIGHT;
+		} else {
+			r->w = w;
+			r->h = w * HEIGHT / WIDTH;
+		}
+	} else {
+		m = (w / WIDTH < h / HEIGHT) ? w / WIDTH : h / HEIGHT;
+		if (m < 1)
+			m = 1;
+		r->w = WIDTH * m;
+		r->h = HEIGHT * m;
+	}
+	r->x = (w - r->w) / 2;
+	r->y = (h - r->h) / 2;
+}
+
+/* Runs on the main thread and shows the newest frame, if there is one */
+void present_screen(void)
+{
+	const u8 *frame;
+	SDL_Rect dst;
+
+	if (!take_frame(&frame) || hidden)
 		return;
-	} else if (ret != LCD_DRAWN) {
+
+	if (!frame) {
+		draw_background();
 		return;
 	}
 
-	for (i = 0; i < WIDTH; i++) {
-		convert_palette(color, palette[line[i]]);
-		SDL_SetRenderDrawColor(renderer, color[0], color[1], color[2], 255);
-		SDL_RenderDrawPoint(renderer, i, ly);
+	shade_to_rgba(pixels, frame, palette, WIDTH * HEIGHT);
+	if (scale > 1) {
+		scale_frame(scaled, pixels, scale, filter);
+		SDL_UpdateTexture(texture, NULL, scaled,
+				  WIDTH * scale * sizeof(u32));
+	} else {
+		SDL_UpdateTexture(texture, NULL, pixels, WIDTH * sizeof(u32));
 	}
+	fit_rect(&dst);
+	clear();
+	SDL_RenderCopy(renderer, texture, NULL, &dst);
 	SDL_RenderPresent(renderer);
 }
 
 void close_sdl(void)
 {
+	SDL_DestroyTexture(texture);
+	texture = NULL;
 	SDL_DestroyRenderer(renderer);
 	renderer = NULL;
 	SDL_DestroyWindow(window);
@@ -88,20 +190,81 @@ void close_sdl(void)
 	SDL_Quit();
 }
 
+static u8 key_button(SDL_Keycode key)
+{
+	switch (key) {
+	case SDLK_x:
+		return BUTTON_A;
+	case SDLK_z:
+		return BUTTON_B;
+	case SDLK_BACKSPACE:
+		return BUTTON_SELECT;
+	case SDLK_RETURN:
+		return BUTTON_START;
+	case SDLK_RIGHT:
+		return BUTTON_RIGHT;
+	case SDLK_LEFT:
+		return BUTTON_LEFT;
+	case SDLK_UP:
+		return BUTTON_UP;
+	case SDLK_DOWN:
+		return BUTTON_DOWN;
+	}
+	return 0;
+}
+
+static void window_event(const SDL_WindowEvent *e)
+{
+	switch (e->event) {
+	case SDL_WINDOWEVENT_MINIMIZED:
+	case SDL_WINDOWEVENT_HIDDEN:
+		hidden = 1;
+		break;
+	case SDL_WINDOWEVENT_RESTORED:
+	case SDL_WINDOWEVENT_SHOWN:
+		hidden = 0;
+		break;
+	default:
+		return;
+	}
+	send_input(INPUT_HIDDEN, hidden);
+}
+
+/*
+ * Handle all pending events, waiting up to a millisecond for the first
+ * one so the main thread does not spin between frames.
+ */
 int handle_event(void)
 {
 	SDL_Event e;
+	u8 old = buttons;
+
+	if (!SDL_WaitEventTimeout(&e, 1))
+		return 0;
 
-	if (SDL_PollEvent(&e) != 0) {
+	do {
 		if (e.type == SDL_QUIT) {
 			return 1;
 		} else if (e.type == SDL_KEYDOWN) {
-			switch (e.key.keysym.sym) {
-			case SDLK_d:
-				enable_debug();
-			}
+			if (e.key.keysym.sym == SDLK_d)
+				send_input(INPUT_DEBUG, 0);
+			if (e.key.keysym.sym == SDLK_TAB && !e.key.repeat)
+				send_input(INPUT_FAST_FORWARD, 1);
+			if (e.key.keysym.sym == SDLK_r && !e.key.repeat)
+				send_input(INPUT_REWIND, 1);
+			buttons |= key_button(e.key.keysym.sym);
+		} else if (e.type == SDL_KEYUP) {
+			if (e.key.keysym.sym == SDLK_TAB)
+				send_input(INPUT_FAST_FORWARD, 0);
+			if (e.key.keysym.sym == SDLK_r)
+				send_input(INPUT_REWIND, 0);
+			buttons &= ~key_button(e.key.keysym.sym);
+		} else if (e.type == SDL_WINDOWEVENT) {
+			window_event(&e.window);
 		}
-	}
+	} while (SDL_PollEvent(&e));
 
+	if (buttons != old)
+		send_input(INPUT_BUTTONS, buttons);
 	return 0;
 }
@@ -1,9 +1,15 @@
+void enable_vsync(void);
+
+void set_display_scale(int factor, int filter, int keep_aspect);
+
 int init_sdl(void);
 
 void close_sdl(void);
 
 void update_screen(void);
 
+void present_screen(void);
+
 void draw_background(void);
 
 int handle_event(void);
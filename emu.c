@@ -0,0 +1,146 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <pthread.h>
+#include <string.h>
+
+#include "gameboy.h"
+
+#include "debug.h"
+#include "emu.h"
+#include "movie.h"
+#include "pace.h"
+#include "rewind.h"
+#include "video.h"
+
+#define INPUT_RING 256
+#define FRESH 4
+
+#define LOAD(p) __atomic_load_n((p), __ATOMIC_ACQUIRE)
+#define STORE(p, v) __atomic_store_n((p), (v), __ATOMIC_RELEASE)
+#define SWAP(p, v) __atomic_exchange_n((p), (v), __ATOMIC_ACQ_REL)
+
+/*
+ * The emulation runs on its own thread, the main thread owns SDL. Input
+ * goes from the main thread to the emulation through a single producer,
+ * single consumer ring. Finished frames go the other way through a
+ * triple buffer: the emulation fills 'back' and swaps it with 'middle',
+ * the main thread swaps 'front' with 'middle' when it is marked FRESH.
+ * Neither side ever waits for the other, a frame the main thread did not
+ * get to in time is replaced by the next one.
+ */
+struct frame_buffer {
+	u8 pixels[HEIGHT * WIDTH];
+	int off;
+};
+
+static struct frame_buffer buffers[3];
+static int back;
+static int middle = 1;
+static int front = 2;
+
+static u16 inputs[INPUT_RING];
+static u32 input_head;
+static u32 input_tail;
+
+static pthread_t thread;
+static void (*emulation_step)(void);
+static int running;
+static int quit;
+
+static void handle_input(void)
+{
+	u32 head = LOAD(&input_head);
+	u16 in;
+
+	while (input_tail != head) {
+		in = inputs[input_tail % INPUT_RING];
+		switch (in >> 8) {
+		case INPUT_BUTTONS:
+			movie_input(in & 0xFF);
+			break;
+		case INPUT_DEBUG:
+			enable_debug();
+			break;
+		case INPUT_FAST_FORWARD:
+			set_fast_forward(in & 0xFF);
+			break;
+		case INPUT_HIDDEN:
+			pause_rendering(in & 0xFF);
+			break;
+		case INPUT_REWIND:
+			set_rewinding(in & 0xFF);
+			break;
+		}
+		input_tail++;
+	}
+	STORE(&input_tail, input_tail);
+}
+
+static void *emulation_main(void *arg)
+{
+	(void) arg;
+
+	while (!LOAD(&quit)) {
+		if (LOAD(&input_head) != input_tail)
+			handle_input();
+		emulation_step();
+	}
+	return NULL;
+}
+
+/* Called from the main thread, input is dropped if the ring is full */
+void send_input(enum input_type type, u8 value)
+{
+	if (input_head - LOAD(&input_tail) >= INPUT_RING)
+		return;
+
+	inputs[input_head % INPUT_RING] = (type << 8) | value;
+	STORE(&input_head, input_head + 1);
+}
+
+/* Called from the emulation thread, a NULL frame means the LCD is off */
+void publish_frame(const u8 *frame)
+{
+	struct frame_buffer *b = &buffers[back];
+
+	b->off = !frame;
+	if (frame)
+		memcpy(b->pixels, frame, sizeof(b->pixels));
+	back = SWAP(&middle, back | FRESH) & ~FRESH;
+}
+
+/*
+ * Called from the main thread. Returns 1 and the newest frame if one was
+ * published since the last call, 'frame' is NULL if the LCD is off.
+ */
+int take_frame(const u8 **frame)
+{
+	struct frame_buffer *b;
+
+	if (!(LOAD(&middle) & FRESH))
+		return 0;
+
+	front = SWAP(&middle, front) & ~FRESH;
+	b = &buffers[front];
+	*frame = b->off ? NULL : b->pixels;
+	return 1;
+}
+
+void start_emulation(void (*step)(void))
+{
+	emulation_step = step;
+	if (pthread_create(&thread, NULL, emulation_main, NULL) != 0)
+		die("could not start emulation thread");
+	running = 1;
+}
+
+void stop_emulation(void)
+{
+	if (!running)
+		return;
+
+	STORE(&quit, 1);
+	pthread_join(thread, NULL);
+	running = 0;
+	quit = 0;
+}
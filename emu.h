@@ -0,0 +1,20 @@
+#ifndef EMU_H
+#define EMU_H
+enum input_type {
+	INPUT_BUTTONS,
+	INPUT_DEBUG,
+	INPUT_FAST_FORWARD,
+	INPUT_HIDDEN,
+	INPUT_REWIND
+};
+
+void start_emulation(void (*step)(void));
+
+void stop_emulation(void);
+
+void send_input(enum input_type type, u8 value);
+
+void publish_frame(const u8 *frame);
+
+int take_frame(const u8 **frame);
+#endif
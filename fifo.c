@@ -0,0 +1,331 @@
+#include <string.h>
+
+#include "gameboy.h"
+
+#include "fifo.h"
+#include "memory.h"
+#include "render.h"
+#include "video.h"
+
+/*
+ * Dot-accurate pixel FIFO renderer. Mode 3 is stepped one dot at a time:
+ * the background fetcher reads the tile number, the low and the high data
+ * byte two dots apart and pushes 8 pixels once the FIFO has run empty,
+ * one pixel is shifted out per dot, and sprite fetches stall the output.
+ * Registers are read on the dot they are used, so writes in the middle of
+ * a line land where they would on hardware, and the length of mode 3
+ * follows SCX, the window and the sprites on the line.
+ */
+
+static u8 frame[HEIGHT][WIDTH];
+static struct scanline line;
+static int window_line;
+static int window_used;
+
+static int dots;
+static int delay;
+static int lx;
+static int discard;
+
+/* Background fetcher */
+static int fstep;
+static int fetch_x;
+static int window;
+static u8 tilenr;
+static u8 data_lo;
+static u8 data_hi;
+
+/* Background FIFO, only refilled once empty */
+static u8 bg_px[8];
+static int bg_len;
+
+/* Sprite FIFO, slot 0 is the next pixel to be shifted out */
+static u8 obj_c[8];
+static u8 obj_f[8];
+static int obj_head;
+
+static int next_spr;
+static int spr_pending;
+static int spr_dots;
+
+static u8 tile_row_byte(u8 nr, int row, int sprite, int hi)
+{
+	int offset = nr * 16;
+
+	if (!sprite && !get_bit(read_memory(0xFF40), 4) && nr < 128)
+		offset += 0x1000;
+	return get_vram()[offset + 2 * row + hi];
+}
+
+static void fetch_tile_number(void)
+{
+	u8 lcdc = read_memory(0xFF40);
+	int map, col, row;
+
+	if (window) {
+		map = get_bit(lcdc, 6) ? 0x1C00 : 0x1800;
+		col = fetch_x & 0x1F;
+		row = window_line / 8;
+	} else {
+		map = get_bit(lcdc, 3) ? 0x1C00 : 0x1800;
+		col = ((read_memory(0xFF43) / 8) + fetch_x) & 0x1F;
+		row = ((u8) (line.ly + read_memory(0xFF42))) / 8;
+	}
+	tilenr = get_vram()[map + (row * 32) + col];
+}
+
+static int fetch_row(void)
+{
+	if (window)
+		return window_line & 7;
+	return (u8) (line.ly + read_memory(0xFF42)) & 7;
+}
+
+static void push_tile(void)
+{
+	int i;
+
+	for (i = 0; i < 8; i++)
+		bg_px[i] = ((data_lo >> (7 - i)) & 0x1) +
+			   (((data_hi >> (7 - i)) & 0x1) << 1);
+	bg_len = 8;
+	fetch_x++;
+	fstep = 0;
+}
+
+static void fetch_step(void)
+{
+	switch (fstep) {
+	case 1:
+		fetch_tile_number();
+		break;
+	case 3:
+		data_lo = tile_row_byte(tilenr, fetch_row(), 0, 0);
+		break;
+	case 5:
+		data_hi = tile_row_byte(tilenr, fetch_row(), 0, 1);
+		break;
+	case 6:
+		if (bg_len == 0)
+			push_tile();
+		return;
+	}
+	fstep++;
+}
+
+static void start_window(void)
+{
+	u8 wx = read_memory(0xFF4B);
+
+	window = 1;
+	window_used = 1;
+	fetch_x = 0;
+	fstep = 0;
+	bg_len = 0;
+	discard = (wx < 7) ? 7 - wx : 0;
+}
+
+static int window_due(void)
+{
+	u8 lcdc = read_memory(0xFF40);
+	int wx = read_memory(0xFF4B) - 7;
+
+	if (window || !get_bit(lcdc, 5) || !get_bit(lcdc, 0))
+		return 0;
+	if (line.ly < read_memory(0xFF4A))
+		return 0;
+	return lx == ((wx < 0) ? 0 : wx);
+}
+
+static int sprite_due(void)
+{
+	if (discard || next_spr >= line.spr_count)
+		return 0;
+	if (!get_bit(read_memory(0xFF40), 1))
+		return 0;
+	return line.spr[next_spr].x - 8 <= lx;
+}
+
+/* Mix a fetched sprite into the sprite FIFO below earlier sprites */
+static void merge_sprite(const struct sprite *sp)
+{
+	int height = get_bit(read_memory(0xFF40), 2) ? 16 : 8;
+	int row = line.ly + 16 - sp->y;
+	u8 nr = sp->tilenr;
+	u8 lo, hi, color;
+	int i, bit, slot;
+
+	if (height == 16)
+		nr &= 0xFE;
+	if (sp->flags & YFLIP)
+		row = height - 1 - row;
+	nr += row >> 3;
+	lo = tile_row_byte(nr, row & 7, 1, 0);
+	hi = tile_row_byte(nr, row & 7, 1, 1);
+
+	for (i = 0; i < 8; i++) {
+		slot = sp->x - 8 + i - lx;
+		if (slot < 0)
+			continue;
+		bit = (sp->flags & XFLIP) ? i : 7 - i;
+		color = ((lo >> bit) & 0x1) + (((hi >> bit) & 0x1) << 1);
+		slot = (obj_head + slot) & 7;
+		if (color && !obj_c[slot]) {
+			obj_c[slot] = color;
+			obj_f[slot] = sp->flags;
+		}
+	}
+}
+
+static u8 shade(u8 palette, u8 color)
+{
+	return (palette >> (2 * color)) & 0x3;
+}
+
+static void output_pixel(void)
+{
+	u8 bg = bg_px[8 - bg_len];
+	u8 oc = obj_c[obj_head];
+	u8 of = obj_f[obj_head];
+	u8 lcdc;
+
+	bg_len--;
+	if (discard) {
+		discard--;
+		return;
+	}
+
+	obj_c[obj_head] = 0;
+	obj_head = (obj_head + 1) & 7;
+
+	lcdc = read_memory(0xFF40);
+	if (!get_bit(lcdc, 0))
+		bg = 0;
+
+	if (oc && !((of & OBJ_BG_PRIORITY) && bg))
+		frame[line.ly][lx] = shade(read_memory((of & PALETTENR) ?
+						       0xFF49 : 0xFF48), oc);
+	else
+		frame[line.ly][lx] = shade(read_memory(0xFF47), bg);
+	lx++;
+}
+
+/* One dot of mode 3, returns 1 once the last pixel of the line is out */
+static int fifo_dot(void)
+{
+	if (delay) {
+		delay--;
+		return 0;
+	}
+
+	if (spr_pending) {
+		if (fstep < 6) {
+			fetch_step();
+			return 0;
+		}
+		if (++spr_dots < 6)
+			return 0;
+		merge_sprite(&line.spr[next_spr++]);
+		spr_pending = sprite_due();
+		spr_dots = 0;
+		return 0;
+	}
+
+	fetch_step();
+	if (bg_len == 0)
+		return 0;
+
+	if (!discard && window_due()) {
+		start_window();
+		return 0;
+	}
+	if (sprite_due()) {
+		spr_pending = 1;
+		spr_dots = 0;
+		return 0;
+	}
+
+	output_pixel();
+	return lx == WIDTH;
+}
+
+static void fifo_begin_line(const struct scanline *sl)
+{
+	line = *sl;
+	if (line.ly == 0)
+		window_line = 0;
+
+	dots = 0;
+	delay = 6;
+	lx = 0;
+	discard = read_memory(0xFF43) & 7;
+	fstep = 0;
+	fetch_x = 0;
+	window = 0;
+	window_used = 0;
+	bg_len = 0;
+	memset(obj_c, 0, sizeof(obj_c));
+	obj_head = 0;
+	next_spr = 0;
+	spr_pending = 0;
+	spr_dots = 0;
+}
+
+static int fifo_transfer(int *clock)
+{
+	while (*clock > 0) {
+		(*clock)--;
+		dots++;
+		if (fifo_dot()) {
+			if (window_used)
+				window_line++;
+			return dots;
+		}
+	}
+	return 0;
+}
+
+static int fifo_end_frame(void)
+{
+	return 0;
+}
+
+static const u8 *fifo_frame(void)
+{
+	return frame[0];
+}
+
+/* The line in progress, the frame itself is not part of a state */
+void fifo_state(struct state *s)
+{
+	STATE(s, line);
+	STATE(s, window_line);
+	STATE(s, window_used);
+	STATE(s, dots);
+	STATE(s, delay);
+	STATE(s, lx);
+	STATE(s, discard);
+	STATE(s, fstep);
+	STATE(s, fetch_x);
+	STATE(s, window);
+	STATE(s, tilenr);
+	STATE(s, data_lo);
+	STATE(s, data_hi);
+	STATE(s, bg_px);
+	STATE(s, bg_len);
+	STATE(s, obj_c);
+	STATE(s, obj_f);
+	STATE(s, obj_head);
+	STATE(s, next_spr);
+	STATE(s, spr_pending);
+	STATE(s, spr_dots);
+}
+
+const struct ppu_backend fifo_ppu = {
+	"fifo",
+	0,
+	fifo_begin_line,
+	fifo_transfer,
+	fifo_end_frame,
+	fifo_frame
+};
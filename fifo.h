@@ -0,0 +1,6 @@
+#ifndef FIFO_H
+#define FIFO_H
+extern const struct ppu_backend fifo_ppu;
+
+void fifo_state(struct state *s);
+#endif
@@ -6,6 +6,7 @@
 
 typedef uint8_t u8;
 typedef uint16_t u16;
+typedef uint32_t u32;
 typedef uint64_t u64;
 
 void usagef(const char *err, ...);
@@ -16,6 +17,8 @@ void errorf(const char *err, ...);
 u8 set_bit(u8 val, int bit);
 u8 reset_bit(u8 val, int bit);
 int get_bit(u8 val, int bit);
+u64 time_ns(void);
+void sleep_until(u64 ns);
 
 struct cpu_info {
 	u16 *PC;
@@ -33,4 +36,25 @@ struct cpu_info {
 };
 
 void cpu_debug_info(struct cpu_info *cpu);
+
+/*
+ * Save states. Every module passes each piece of its state through
+ * state_bytes(), which depending on the mode only counts the bytes,
+ * copies them to the buffer or copies them back from it.
+ */
+enum state_mode {
+	STATE_SIZE,
+	STATE_SAVE,
+	STATE_LOAD
+};
+
+struct state {
+	enum state_mode mode;
+	u8 *buf;
+	size_t pos;
+};
+
+void state_bytes(struct state *s, void *data, size_t n);
+
+#define STATE(s, v) state_bytes((s), &(v), sizeof(v))
 #endif
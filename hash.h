@@ -0,0 +1,6 @@
+#ifndef HASH_H
+#define HASH_H
+u64 hash64(const u8 *p, size_t len, u64 seed);
+
+u64 hash_frame(const u8 *frame);
+#endif
@@ -78,3 +78,8 @@ void request_interrupt(int interrupt)
 		break;
 	}
 }
+
+void interrupt_state(struct state *s)
+{
+	STATE(s, interrupt_master_enable);
+}
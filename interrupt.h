@@ -13,3 +13,5 @@ int get_ime(void);
 int execute_interrupt(void);
 
 void request_interrupt(int);
+
+void interrupt_state(struct state *s);
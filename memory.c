@@ -4,8 +4,11 @@
 #include "gameboy.h"
 
 #include "error.h"
+#include "hash.h"
+#include "interrupt.h"
 #include "mbc.h"
 #include "memory.h"
+#include "video.h"
 
 #define N_LOGO_OFFSET 0x104
 
@@ -21,8 +24,12 @@
 
 /* Cartridge type address */
 #define CART_TYPE 0x147
+/* Cartridge RAM size address */
+#define RAM_SIZE 0x149
 
 static int bootrom;
+/* Switchable ROM banks read */
+static int rom_banks;
 
 static struct mem {
 	u8 bootrom[256];
@@ -47,6 +54,24 @@ static struct mem {
 
 } memory;
 
+/* First page of VRAM, the cartridge RAM banks and WRAM */
+#define VRAM_PAGE 0
+#define CART_PAGE (0x2000 / PAGE_BYTES)
+#define WRAM_PAGE (0x22000 / PAGE_BYTES)
+
+/* Pages written since the last take_dirty_pages() */
+static u64 dirty[PAGE_WORDS];
+/* Pages that exist on the cartridge */
+static u64 tracked[PAGE_WORDS];
+
+/* Set when loading changed VRAM, until take_vram_changed() */
+static int vram_changed;
+
+static void mark_dirty(int page)
+{
+	dirty[page / 64] |= (u64) 1 << (page % 64);
+}
+
 static int cmp_nintendo_logo(void)
 {
 	int i;
@@ -91,11 +116,39 @@ void read_bootrom(const u8 *buffer)
 
 void read_rom(const u8 *buffer, int count)
 {
-	if (count != -1)
+	if (count != -1) {
 		memcpy(memory.rom_bank[count], buffer, 0x4000);
-	else
+		if (count >= rom_banks)
+			rom_banks = count + 1;
+	} else {
 		memcpy(memory.rom, buffer, 0x4000);
+	}
+}
 
+/* Pressed buttons, see enum button */
+static u8 buttons;
+
+/* Recompute the low nibble of P1, a pressed button in a selected row reads 0 */
+static void update_joypad(void)
+{
+	u8 *p1 = &memory.io_reg[0];
+	u8 keys = 0;
+
+	if (!get_bit(*p1, 4))
+		keys |= buttons >> 4;
+	if (!get_bit(*p1, 5))
+		keys |= buttons & 0x0F;
+	*p1 = (*p1 & 0xF0) | (~keys & 0x0F);
+}
+
+void set_buttons(u8 pressed)
+{
+	u8 down = pressed & ~buttons;
+
+	buttons = pressed;
+	update_joypad();
+	if (down)
+		request_interrupt(INT_JOYPAD);
 }
 
 static void change_mbc_mode(u8 value)
@@ -119,6 +172,7 @@ static void write_io(u16 address, u8 value)
 	u8 *addr = &memory.io_reg[offset];
 	if (address == 0xFF00) {
 		*addr = (*addr & 0xCF) + (value & 0x30);
+		update_joypad();
 	} else if (address == 0xFF41) {
 		*addr = (*addr & 0x07) + (value & 0xF8);
 	} else if (address == 0xFF44) {
@@ -166,24 +220,30 @@ void write_memory(u16 address, u8 value)
 		offset = address - MEM_VRAM;
 
 		memory.vram[offset] = value;
+		mark_dirty(VRAM_PAGE + offset / PAGE_BYTES);
+		vram_written(offset, value);
 		break;
 	case 0xA:
 	case 0xB:
 		offset = address - MEM_RAM;
 
 		memory.curr_ram[offset] = value;
+		mark_dirty(CART_PAGE + (memory.curr_ram - memory.ram_bank[0] +
+					offset) / PAGE_BYTES);
 		break;
 	case 0xC:
 	case 0xD:
 		offset = address - MEM_WRAM;
 
 		memory.wram[offset] = value;
+		mark_dirty(WRAM_PAGE + offset / PAGE_BYTES);
 		break;
 	case 0xE:
 	case 0xF:
 		if (address <= 0xFDFF) {
 			offset = (address - MEM_WRAM) - 0x2000;
 			memory.wram[offset] = value;
+			mark_dirty(WRAM_PAGE + offset / PAGE_BYTES);
 		} else if (address <= 0xFE9F) {
 			offset = (address - MEM_SPRITE_TABLE);
 			memory.sprite_table[offset] = value;
@@ -290,11 +350,55 @@ void write_stat(u8 v)
 	memory.io_reg[0x41] = v;
 }
 
+const u8 *get_vram(void)
+{
+	return memory.vram;
+}
+
+const u8 *get_oam(void)
+{
+	return memory.sprite_table;
+}
+
+/* Identifies the ROM, the boot ROM is not part of it */
+u64 rom_hash(void)
+{
+	u64 h = hash64(memory.rom, sizeof(memory.rom), 0);
+	int i;
+
+	for (i = 0; i < rom_banks; i++)
+		h = hash64(memory.rom_bank[i], sizeof(memory.rom_bank[i]), h);
+	return h;
+}
+
+u64 bootrom_hash(void)
+{
+	return hash64(memory.bootrom, sizeof(memory.bootrom), 0);
+}
+
 int bootrom_loaded(void)
 {
 	return bootrom;
 }
 
+/* Until the boot ROM unmaps itself by writing to 0xFF50 */
+int bootrom_mapped(void)
+{
+	return bootrom && !(memory.io_reg[0x50] & 0x1);
+}
+
+static int ram_banks(void);
+
+/* Leave out the RAM banks the cartridge does not have */
+static void track_pages(void)
+{
+	int i;
+
+	memset(tracked, 0xFF, sizeof(tracked));
+	for (i = CART_PAGE + ram_banks() * 0x2000 / PAGE_BYTES; i < WRAM_PAGE; i++)
+		tracked[i / 64] &= ~((u64) 1 << (i % 64));
+}
+
 int init_memory(void)
 {
 	if (!bootrom_loaded()) {
@@ -349,6 +453,146 @@ int init_memory(void)
 	memory.curr_rom = memory.rom_bank[0];
 	memory.curr_ram = memory.ram_bank[0];
 	memory.interrupt_enable = 0;
+	memset(dirty, 0xFF, sizeof(dirty));
+	track_pages();
 
 	return 0;
 }
+
+/* Number of 8 KB RAM banks on the cartridge, 2 KB carts count as one */
+static int ram_banks(void)
+{
+	switch (memory.rom[RAM_SIZE]) {
+	case 1:
+	case 2:
+		return 1;
+	case 3:
+		return 4;
+	case 4:
+		return 16;
+	case 5:
+		return 8;
+	}
+	return 0;
+}
+
+/*
+ * OAM, IO, HRAM and IE. P1 is recomputed from the buttons held right now.
+ */
+void memory_state(struct state *s)
+{
+	STATE(s, memory.sprite_table);
+	STATE(s, memory.io_reg);
+	STATE(s, memory.hram);
+	STATE(s, memory.interrupt_enable);
+
+	if (s->mode == STATE_LOAD)
+		update_joypad();
+}
+
+/* The bank pointers are kept as bank numbers */
+void mbc_state(struct state *s)
+{
+	u8 ram_nr = (memory.curr_ram - memory.ram_bank[0]) / 0x2000;
+
+	STATE(s, memory.mbc_mode);
+	STATE(s, memory.selected_rom);
+	STATE(s, memory.ram_enable);
+	STATE(s, ram_nr);
+
+	if (s->mode == STATE_LOAD) {
+		memory.curr_rom = memory.rom_bank[memory.selected_rom];
+		memory.curr_ram = memory.ram_bank[ram_nr];
+	}
+}
+
+/* Copy in page 'nr', returns whether it changed */
+static int load_page(int nr, const u8 *src)
+{
+	u8 *p = ram_page(nr);
+
+	if (!memcmp(p, src, PAGE_BYTES))
+		return 0;
+	memcpy(p, src, PAGE_BYTES);
+	if (nr < CART_PAGE)
+		vram_changed = 1;
+	return 1;
+}
+
+/*
+ * VRAM, the cartridge's RAM banks and WRAM. Loading only dirties the pages
+ * that change, so loading a state close to the current one, like run-ahead
+ * does every frame, keeps later snapshots small and the PPU's caches.
+ */
+void ram_state(struct state *s)
+{
+	int i;
+
+	if (s->mode != STATE_LOAD) {
+		STATE(s, memory.vram);
+		state_bytes(s, memory.ram_bank,
+			    ram_banks() * sizeof(memory.ram_bank[0]));
+		STATE(s, memory.wram);
+		return;
+	}
+
+	for (i = 0; i < RAM_PAGES; i++) {
+		if (!(tracked[i / 64] >> (i % 64) & 1))
+			continue;
+		if (load_page(i, s->buf + s->pos))
+			mark_dirty(i);
+		s->pos += PAGE_BYTES;
+	}
+}
+
+/* Copy in 'n' pages from page 'nr' on without marking them dirty */
+void load_pages(int nr, int n, const u8 *src)
+{
+	int i;
+
+	for (i = 0; i < n; i++)
+		load_page(nr + i, src + i * PAGE_BYTES);
+}
+
+/* Whether a load changed VRAM since the last call */
+int take_vram_changed(void)
+{
+	int changed = vram_changed;
+
+	vram_changed = 0;
+	return changed;
+}
+
+/* The pages that exist on this cartridge */
+void ram_pages(u64 *pages)
+{
+	memcpy(pages, tracked, sizeof(tracked));
+}
+
+/* Hand out the pages written since the last call and start over */
+void take_dirty_pages(u64 *pages)
+{
+	int i;
+
+	for (i = 0; i < PAGE_WORDS; i++)
+		pages[i] = dirty[i] & tracked[i];
+	memset(dirty, 0, sizeof(dirty));
+}
+
+/* Give back pages taken with take_dirty_pages() that were not used */
+void mark_pages_dirty(const u64 *pages)
+{
+	int i;
+
+	for (i = 0; i < PAGE_WORDS; i++)
+		dirty[i] |= pages[i];
+}
+
+u8 *ram_page(int nr)
+{
+	if (nr >= WRAM_PAGE)
+		return memory.wram + (nr - WRAM_PAGE) * PAGE_BYTES;
+	if (nr >= CART_PAGE)
+		return memory.ram_bank[0] + (nr - CART_PAGE) * PAGE_BYTES;
+	return memory.vram + nr * PAGE_BYTES;
+}
@@ -5,13 +5,48 @@ enum {
 	MBC1
 } mode;
 
+/* Action buttons in the low nibble, directions in the high nibble */
+enum button {
+	BUTTON_A = 1 << 0,
+	BUTTON_B = 1 << 1,
+	BUTTON_SELECT = 1 << 2,
+	BUTTON_START = 1 << 3,
+	BUTTON_RIGHT = 1 << 4,
+	BUTTON_LEFT = 1 << 5,
+	BUTTON_UP = 1 << 6,
+	BUTTON_DOWN = 1 << 7
+};
+
+/*
+ * VRAM, cartridge RAM and WRAM are tracked in pages of PAGE_BYTES for
+ * incremental snapshots, as bitmaps of PAGE_WORDS words.
+ */
+#define PAGE_BYTES 256
+#define RAM_PAGES (0x24000 / PAGE_BYTES)
+#define PAGE_WORDS (RAM_PAGES / 64)
+
 void read_bootrom(const u8 *buffer);
 void read_rom(const unsigned char *buffer, int count);
 void write_memory(unsigned short addr, unsigned char value);
 unsigned char read_memory(unsigned short addr);
 void write_ly(u8 v);
 void write_joypad(u8 v);
+void set_buttons(u8 pressed);
 void write_stat(u8 v);
+const u8 *get_vram(void);
+const u8 *get_oam(void);
+u64 rom_hash(void);
+u64 bootrom_hash(void);
 int bootrom_loaded(void);
+int bootrom_mapped(void);
 int init_memory(void);
+void memory_state(struct state *s);
+void mbc_state(struct state *s);
+void ram_state(struct state *s);
+void ram_pages(u64 *pages);
+void take_dirty_pages(u64 *pages);
+void mark_pages_dirty(const u64 *pages);
+u8 *ram_page(int nr);
+void load_pages(int nr, int n, const u8 *src);
+int take_vram_changed(void);
 #endif
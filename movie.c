@@ -0,0 +1,269 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "gameboy.h"
+
+#include "cpu.h"
+#include "hash.h"
+#include "memory.h"
+#include "movie.h"
+#include "state.h"
+#include "timer.h"
+#include "video.h"
+
+#define MAGIC "TMPGBMV1"
+#define MAGIC_LEN 8
+#define HEADER_LEN (MAGIC_LEN + 16)
+#define RECORD_LEN 17
+
+enum {
+	TAG_BUTTONS = 'B',
+	TAG_HASH = 'H',
+	TAG_END = 'E'
+};
+
+/*
+ * Input movies. A movie starts with a magic, the ROM's hash, the size of a
+ * state and the state the machine started in, followed by records of a
+ * tag, the cycle since the machine was started and a value. They hold
+ * every change of the buttons and, if asked for, a hash of the emulated
+ * machine at every VBlank, and end with an end record. All numbers are
+ * little endian.
+ *
+ * Buttons are applied before the first instruction at or after their
+ * cycle, which is where handle_input() applied them while recording, so
+ * a replay runs exactly the same instructions.
+ */
+static FILE *out;
+static int hashes;
+static int write_error;
+
+static u8 *state;
+static size_t state_len;
+
+static u8 *movie;
+static size_t movie_len;
+static size_t pos;
+static int playing;
+static long frame_nr;
+static long desync = -1;
+
+/* Buttons held right now */
+static u8 held;
+
+static void put64(u8 *p, u64 v)
+{
+	int i;
+
+	for (i = 0; i < 8; i++)
+		p[i] = v >> (8 * i);
+}
+
+static u64 get64(const u8 *p)
+{
+	u64 v = 0;
+	int i;
+
+	for (i = 7; i >= 0; i--)
+		v = v << 8 | p[i];
+	return v;
+}
+
+/* Leaves out frame skipping and what else depends on the host */
+static u64 state_hash(void)
+{
+	return hash64(state, save_machine(state), 0);
+}
+
+static void desynced(void)
+{
+	if (desync >= 0)
+		return;
+	desync = frame_nr;
+	fprintf(stderr, "movie desynced at frame %ld\n", desync);
+}
+
+static void write_record(int tag, u64 value)
+{
+	u8 r[RECORD_LEN];
+
+	r[0] = tag;
+	put64(r + 1, elapsed_cycles());
+	put64(r + 9, value);
+	if (fwrite(r, 1, RECORD_LEN, out) != RECORD_LEN)
+		write_error = 1;
+}
+
+/*
+ * Record to 'path' from the current state on, with a state hash every
+ * frame if 'with_hashes' is set. Returns -1 if the file can't be written.
+ */
+int start_movie(const char *path, int with_hashes)
+{
+	u8 h[HEADER_LEN];
+
+	state_len = state_size();
+	state = malloc(state_len);
+	out = fopen(path, "wb");
+	if (!state || !out)
+		return -1;
+
+	hashes = with_hashes;
+	memcpy(h, MAGIC, MAGIC_LEN);
+	put64(h + MAGIC_LEN, rom_hash());
+	put64(h + MAGIC_LEN + 8, state_len);
+	save_state(state);
+	if (fwrite(h, 1, HEADER_LEN, out) != HEADER_LEN ||
+	    fwrite(state, 1, state_len, out) != state_len)
+		return -1;
+	/* The state does not hold the buttons */
+	write_record(TAG_BUTTONS, held);
+	return 0;
+}
+
+void stop_movie(void)
+{
+	if (!out)
+		return;
+
+	write_record(TAG_END, 0);
+	if (fclose(out) != 0 || write_error)
+		errorf("could not write movie");
+	out = NULL;
+}
+
+/*
+ * Start playing the movie at 'path' from its start state. Returns -1 if
+ * it can't be read or was recorded with another ROM.
+ */
+int load_movie(const char *path)
+{
+	FILE *fp;
+	long len;
+
+	fp = fopen(path, "rb");
+	if (!fp)
+		return -1;
+	if (fseek(fp, 0, SEEK_END) != 0 || (len = ftell(fp)) < HEADER_LEN ||
+	    fseek(fp, 0, SEEK_SET) != 0) {
+		fclose(fp);
+		return -1;
+	}
+	movie_len = len;
+	movie = malloc(movie_len);
+	if (!movie || fread(movie, 1, movie_len, fp) != movie_len) {
+		fclose(fp);
+		return -1;
+	}
+	fclose(fp);
+
+	state_len = state_size();
+	state = malloc(state_len);
+	if (!state || memcmp(movie, MAGIC, MAGIC_LEN) ||
+	    get64(movie + MAGIC_LEN) != rom_hash() ||
+	    get64(movie + MAGIC_LEN + 8) != state_len ||
+	    HEADER_LEN + state_len > movie_len)
+		return -1;
+
+	load_state(movie + HEADER_LEN);
+	pos = HEADER_LEN + state_len;
+	playing = 1;
+	return 0;
+}
+
+int movie_playing(void)
+{
+	return playing;
+}
+
+/* Buttons from the user, ignored while playing */
+void movie_input(u8 buttons)
+{
+	if (playing)
+		return;
+	if (out)
+		write_record(TAG_BUTTONS, buttons);
+	held = buttons;
+	set_buttons(buttons);
+}
+
+static const u8 *next_record(void)
+{
+	if (pos + RECORD_LEN > movie_len) {
+		playing = 0;
+		return NULL;
+	}
+	return movie + pos;
+}
+
+/* Called before every instruction */
+void movie_step(void)
+{
+	const u8 *r;
+	u64 now;
+
+	if (!playing)
+		return;
+
+	now = elapsed_cycles();
+	while ((r = next_record()) && get64(r + 1) <= now) {
+		if (r[0] == TAG_BUTTONS) {
+			set_buttons(r[9]);
+		} else if (r[0] == TAG_END) {
+			playing = 0;
+			return;
+		} else if (r[0] == TAG_HASH && get64(r + 1) < now) {
+			/* The frame never came */
+			desynced();
+		} else {
+			return;
+		}
+		pos += RECORD_LEN;
+	}
+}
+
+/* Called on every VBlank */
+void movie_frame(void)
+{
+	const u8 *r;
+
+	frame_nr++;
+	if (out && hashes)
+		write_record(TAG_HASH, state_hash());
+
+	if (!playing)
+		return;
+	r = next_record();
+	if (!r || r[0] != TAG_HASH)
+		return;
+	if (get64(r + 1) != elapsed_cycles() || get64(r + 9) != state_hash())
+		desynced();
+	pos += RECORD_LEN;
+}
+
+/* The first frame that did not match the movie, or -1 */
+long movie_desync(void)
+{
+	return desync;
+}
+
+/*
+ * Play the loaded movie to its end on this thread as fast as possible.
+ * Stops at the first frame that does not match and returns its number, or
+ * -1 if every frame matched. Frames are counted in VBlanks.
+ */
+long replay_movie(void)
+{
+	int ret;
+
+	while (playing && desync < 0) {
+		movie_step();
+		update_timer();
+		ret = draw();
+		if (ret != LCD_OFF && (ret & LCD_VBLANK))
+			movie_frame();
+		fetch_opcode();
+	}
+	return desync;
+}
@@ -0,0 +1,20 @@
+#ifndef MOVIE_H
+#define MOVIE_H
+int start_movie(const char *path, int hashes);
+
+void stop_movie(void);
+
+int load_movie(const char *path);
+
+int movie_playing(void);
+
+void movie_input(u8 buttons);
+
+void movie_step(void);
+
+void movie_frame(void);
+
+long movie_desync(void);
+
+long replay_movie(void);
+#endif
@@ -0,0 +1,54 @@
+#include "gameboy.h"
+
+#include "pace.h"
+#include "video.h"
+
+/* Frames behind after which the pacer stops trying to catch up */
+#define MAX_LAG 4
+
+/*
+ * Frame pacing. Every FRAME_CYCLES emulated cycles the emulation thread
+ * sleeps until an absolute deadline that advances by one frame time, so
+ * the time spent emulating and oversleeping is made up on the next frame
+ * instead of adding up. If the emulation falls too far behind, e.g. after
+ * the debugger stopped it, the deadline restarts from now.
+ */
+static double speed = 1.0;
+static int fast_forward;
+static int cycles;
+static u64 deadline;
+
+/* Run at 'speed' times the Game Boy frame rate, 0 for no limit */
+void set_speed(double s)
+{
+	speed = s;
+	set_target_speed(s);
+	deadline = 0;
+}
+
+void set_fast_forward(int on)
+{
+	fast_forward = on;
+	deadline = 0;
+}
+
+void pace(int elapsed)
+{
+	u64 now, frame;
+
+	cycles += elapsed;
+	if (cycles < FRAME_CYCLES)
+		return;
+	cycles -= FRAME_CYCLES;
+
+	if (fast_forward || speed <= 0)
+		return;
+
+	frame = FRAME_NS / speed;
+	now = time_ns();
+	if (!deadline || now > deadline + MAX_LAG * frame)
+		deadline = now;
+	deadline += frame;
+	if (deadline > now)
+		sleep_until(deadline);
+}
@@ -0,0 +1,8 @@
+#ifndef PACE_H
+#define PACE_H
+void set_speed(double speed);
+
+void set_fast_forward(int on);
+
+void pace(int cycles);
+#endif
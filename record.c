@@ -0,0 +1,209 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "gameboy.h"
+
+#include "record.h"
+#include "video.h"
+
+#define RECORD_RING 64
+#define FRAME_SIZE (WIDTH * HEIGHT)
+
+#define LOAD(p) __atomic_load_n((p), __ATOMIC_SEQ_CST)
+#define STORE(p, v) __atomic_store_n((p), (v), __ATOMIC_SEQ_CST)
+
+/*
+ * Video capture. The thread that finishes a frame copies every recorded
+ * one into a ring and a writer thread encodes and writes it out. When the
+ * ring is full the frame is dropped and counted, the emulation never
+ * waits for the disk.
+ *
+ * Files ending in .y4m get a YUV4MPEG2 stream with a single gray plane,
+ * anything else raw frames of packed 2bpp shades, 4 pixels per byte with
+ * the leftmost one in the top bits.
+ */
+static const u8 luma[4] = { 0xCC, 0xB2, 0x66, 0x19 };
+
+static u8 ring[RECORD_RING][FRAME_SIZE];
+static u32 head;
+static u32 tail;
+
+static FILE *fp;
+static int y4m;
+static int every;
+static u64 seen;
+static u64 written;
+static u64 dropped;
+static int write_error;
+
+static pthread_t thread;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t work = PTHREAD_COND_INITIALIZER;
+static int writer_waiting;
+static int recording;
+static int quit;
+
+static void write_frame(const u8 *frame)
+{
+	static u8 buf[FRAME_SIZE];
+	size_t n;
+	int i;
+
+	if (y4m) {
+		for (i = 0; i < FRAME_SIZE; i++)
+			buf[i] = luma[frame[i]];
+		n = FRAME_SIZE;
+		if (fputs("FRAME\n", fp) == EOF)
+			write_error = 1;
+	} else {
+		for (i = 0; i < FRAME_SIZE / 4; i++)
+			buf[i] = (frame[4 * i] << 6) | (frame[4 * i + 1] << 4) |
+				 (frame[4 * i + 2] << 2) | frame[4 * i + 3];
+		n = FRAME_SIZE / 4;
+	}
+	if (fwrite(buf, 1, n, fp) != n)
+		write_error = 1;
+	written++;
+}
+
+static void wait_for_frames(void)
+{
+	pthread_mutex_lock(&lock);
+	STORE(&writer_waiting, 1);
+	while (!LOAD(&quit) && LOAD(&head) == tail)
+		pthread_cond_wait(&work, &lock);
+	STORE(&writer_waiting, 0);
+	pthread_mutex_unlock(&lock);
+}
+
+/*
+ * Warn at most once a second while frames are being dropped. This runs on
+ * the writer so the emulation thread never prints.
+ */
+static void report_drops(void)
+{
+	static u64 reported;
+	static u64 last;
+	u64 n = LOAD(&dropped);
+	u64 now;
+
+	if (n == reported)
+		return;
+	now = time_ns();
+	if (last && now - last < 1000000000)
+		return;
+	fprintf(stderr, "recording fell behind, %lu frames dropped so far\n",
+		(unsigned long) n);
+	reported = n;
+	last = now;
+}
+
+static void *writer_main(void *arg)
+{
+	(void) arg;
+
+	for (;;) {
+		report_drops();
+		if (LOAD(&head) == tail) {
+			if (LOAD(&quit))
+				break;
+			wait_for_frames();
+			continue;
+		}
+		write_frame(ring[tail % RECORD_RING]);
+		STORE(&tail, tail + 1);
+	}
+	return NULL;
+}
+
+/* Record every nth frame passed to record_frame() to 'path' */
+int start_recording(const char *path, int n)
+{
+	size_t len = strlen(path);
+
+	fp = fopen(path, "wb");
+	if (!fp)
+		return -1;
+
+	every = n;
+	y4m = len >= 4 && !strcmp(path + len - 4, ".y4m");
+	if (y4m)
+		fprintf(fp, "YUV4MPEG2 W%d H%d F%d:%d Ip A1:1 Cmono\n",
+			WIDTH, HEIGHT, 4194304, FRAME_CYCLES * every);
+
+	if (pthread_create(&thread, NULL, writer_main, NULL) != 0) {
+		fclose(fp);
+		return -1;
+	}
+	recording = 1;
+	return 0;
+}
+
+/*
+ * Called for every finished frame, on the emulation thread or with -r on
+ * the render thread, never on both.
+ */
+void record_frame(const u8 *frame)
+{
+	if (!recording || seen++ % every)
+		return;
+
+	if (head - LOAD(&tail) >= RECORD_RING) {
+		__atomic_add_fetch(&dropped, 1, __ATOMIC_RELEASE);
+		return;
+	}
+	memcpy(ring[head % RECORD_RING], frame, FRAME_SIZE);
+	STORE(&head, head + 1);
+
+	if (LOAD(&writer_waiting)) {
+		pthread_mutex_lock(&lock);
+		pthread_cond_signal(&work);
+		pthread_mutex_unlock(&lock);
+	}
+}
+
+/* Write out what is left in the ring and report what was recorded */
+void stop_recording(void)
+{
+	if (!recording)
+		return;
+
+	pthread_mutex_lock(&lock);
+	STORE(&quit, 1);
+	pthread_cond_signal(&work);
+	pthread_mutex_unlock(&lock);
+	pthread_join(thread, NULL);
+
+	if (fclose(fp) != 0)
+		write_error = 1;
+	recording = 0;
+
+	fprintf(stderr, "recorded %lu frames, dropped %lu\n",
+		(unsigned long) written, (unsigned long) dropped);
+	if (write_error)
+		errorf("could not write recording");
+}
+
+/* Write a single frame as a binary PGM image */
+int dump_frame(const char *path, const u8 *frame)
+{
+	u8 buf[FRAME_SIZE];
+	FILE *out;
+	int i, ret = 0;
+
+	out = fopen(path, "wb");
+	if (!out)
+		return -1;
+
+	for (i = 0; i < FRAME_SIZE; i++)
+		buf[i] = luma[frame[i]];
+	if (fprintf(out, "P5\n%d %d\n255\n", WIDTH, HEIGHT) < 0 ||
+	    fwrite(buf, 1, FRAME_SIZE, out) != FRAME_SIZE)
+		ret = -1;
+	if (fclose(out) != 0)
+		ret = -1;
+	return ret;
+}
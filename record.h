@@ -0,0 +1,10 @@
+#ifndef RECORD_H
+#define RECORD_H
+int start_recording(const char *path, int every);
+
+void record_frame(const u8 *frame);
+
+void stop_recording(void);
+
+int dump_frame(const char *path, const u8 *frame);
+#endif
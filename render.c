@@ -0,0 +1,392 @@
+#include <string.h>
+
+#include "gameboy.h"
+
+#include "compose.h"
+#include "memory.h"
+#include "render.h"
+#include "video.h"
+
+enum px_type {
+	BG,
+	SPRITE,
+	WINDOW
+};
+
+/*
+ * The renderer only sees VRAM through 'vram' and the registers captured
+ * in a struct scanline, so it can run on the emulation thread against
+ * the live VRAM or on a render thread against a copy.
+ */
+static const u8 *vram;
+static u8 lcdc;
+static u8 ly;
+static int spr_height;
+static u8 bg_line[WIDTH];
+static u8 frame[HEIGHT][WIDTH];
+static u8 bg_palette[4] = { 0, 1, 2, 3 };
+/* OBP0 followed by OBP1 */
+static u8 obj_palette[8] = { 0, 1, 2, 3, 0, 1, 2, 3 };
+
+/* Sprite pixels of the current line, color 0 is transparent */
+static u8 obj_color[WIDTH];
+static u8 obj_flags[WIDTH];
+
+/*
+ * What each line of the last drawn frame was made of. A line is drawn
+ * again only if it was not drawn in the previous frame, one of the
+ * registers it depends on changed, it shows different sprites, or one of
+ * the map rows or tiles it used was written since.
+ */
+struct line_state {
+	u64 frame;
+	u8 regs[LINE_REGS];
+	u64 tiles[TILE_COUNT / 64];
+	u64 map_rows;
+	int spr_count;
+	struct sprite spr[MAX_SPRITES];
+};
+
+static struct line_state lines[HEIGHT];
+static u64 frame_count;
+static int frame_changed;
+
+/* Tiles and map rows written during the previous [0] and current [1] frame */
+static u64 tiles_written[2][TILE_COUNT / 64];
+static u64 map_rows_written[2];
+
+/*
+ * Decoded tile data. Every tile is kept as 8 rows of 8 color numbers, once
+ * as stored in VRAM and once flipped horizontally. VRAM writes only mark
+ * the tile dirty, it is decoded again before the next line is drawn.
+ */
+static u8 tile_cache[2][TILE_COUNT][8][8];
+static u8 tile_dirty[TILE_COUNT / 8];
+static int tiles_dirty;
+static u32 tile_version[TILE_COUNT];
+
+/*
+ * Both tile maps drawn out to 256x256 pixels. Every map entry remembers
+ * the tile and tile version it was drawn with. VRAM writes and changes of
+ * the tile data area (LCDC bit 4) bump vram_gen, and a map row is checked
+ * against its entries only when vram_gen moved since the row was last used.
+ */
+static u8 map_cache[2][256][256];
+static u16 map_tile[2][1024];
+static u32 map_version[2][1024];
+static u32 map_row_gen[2][32];
+static u32 vram_gen = 1;
+static int tile_mode;
+
+void set_render_vram(const u8 *data)
+{
+	vram = data;
+}
+
+static void invalidate_tile(u16 offset)
+{
+	int tile = offset >> 4;
+
+	tile_dirty[tile >> 3] |= 1U << (tile & 7);
+	tiles_dirty = 1;
+	tiles_written[1][tile >> 6] |= (u64) 1 << (tile & 63);
+}
+
+static void invalidate_map(u16 offset)
+{
+	int row = (offset - TILE_DATA_SIZE) >> 5;
+
+	map_rows_written[1] |= (u64) 1 << row;
+	vram_gen++;
+}
+
+void render_vram_write(u16 offset)
+{
+	if (offset < TILE_DATA_SIZE)
+		invalidate_tile(offset);
+	else
+		invalidate_map(offset);
+}
+
+static void use_tile(int tile)
+{
+	lines[ly].tiles[tile >> 6] |= (u64) 1 << (tile & 63);
+}
+
+static void decode_tile(int tile)
+{
+	expand_tile(vram + (tile * 16), tile_cache[0][tile][0],
+		    tile_cache[1][tile][0]);
+	tile_version[tile]++;
+}
+
+static void update_tile_cache(void)
+{
+	int i, bit;
+
+	if (!tiles_dirty)
+		return;
+
+	for (i = 0; i < TILE_COUNT / 8; i++) {
+		if (!tile_dirty[i])
+			continue;
+		for (bit = 0; bit < 8; bit++)
+			if (get_bit(tile_dirty[i], bit))
+				decode_tile(i * 8 + bit);
+		tile_dirty[i] = 0;
+	}
+	tiles_dirty = 0;
+	vram_gen++;
+}
+
+/* Map a tile number to its index in the tile cache (0 - 383) */
+static int tile_index(u8 tilenr, enum px_type type)
+{
+	if (type != SPRITE && !get_bit(lcdc, 4) && tilenr < 128)
+		return tilenr + 256;
+	return tilenr;
+}
+
+/* Redraw the entries of a map row whose tile or tile data changed */
+static void update_map_row(int m, int r)
+{
+	const u8 *entries = vram + TILE_DATA_SIZE + (m * 0x400) + (r * 32);
+	int i, y, e, tile;
+
+	if (map_row_gen[m][r] == vram_gen)
+		return;
+
+	for (i = 0; i < 32; i++) {
+		e = r * 32 + i;
+		tile = tile_index(entries[i], BG);
+		if (map_tile[m][e] == tile &&
+		    map_version[m][e] == tile_version[tile])
+			continue;
+
+		for (y = 0; y < 8; y++)
+			memcpy(&map_cache[m][r * 8 + y][i * 8],
+			       tile_cache[0][tile][y], 8);
+		map_tile[m][e] = tile;
+		map_version[m][e] = tile_version[tile];
+	}
+	map_row_gen[m][r] = vram_gen;
+}
+
+static const u8 *sprite_row(const struct sprite *sp)
+{
+	int row = ly + 16 - sp->y;
+	u8 tilenr = sp->tilenr;
+
+	if (spr_height == 16)
+		tilenr &= 0xFE;
+	if (sp->flags & YFLIP)
+		row = spr_height - 1 - row;
+	tilenr += row >> 3;
+
+	use_tile(tilenr);
+	return tile_cache[(sp->flags & XFLIP) ? 1 : 0][tilenr][row & 7];
+}
+
+/*
+ * Draw the selected sprites into the sprite line buffer. Sprites are
+ * visited in priority order and never overwrite an opaque pixel of a
+ * sprite drawn before them.
+ */
+static void render_sprites(const struct scanline *sl)
+{
+	const struct sprite *spr = sl->spr;
+	const u8 *row;
+	int i, px, x;
+
+	memset(obj_color, 0, WIDTH);
+	if (!get_bit(lcdc, 1))
+		return;
+
+	for (i = 0; i < sl->spr_count; i++) {
+		row = sprite_row(&spr[i]);
+		for (px = 0; px < 8; px++) {
+			x = spr[i].x - 8 + px;
+			if (x < 0 || x >= WIDTH)
+				continue;
+			if (obj_color[x] || !row[px])
+				continue;
+			obj_color[x] = row[px];
+			obj_flags[x] = spr[i].flags;
+		}
+	}
+}
+
+/*
+ * Copy the pixels of a map line starting at map coordinates 'mapx'/'mapy'
+ * to 'line' from screen position 'x' on, wrapping around at the right
+ * edge of the map.
+ */
+static void map_line(u8 *line, int x, int m, u8 mapx, u8 mapy)
+{
+	int r = mapy / 8;
+	int n = WIDTH - x;
+	int first = 256 - mapx;
+	int i;
+
+	update_map_row(m, r);
+
+	lines[ly].map_rows |= (u64) 1 << ((m * 32) + r);
+	for (i = mapx / 8; i <= (mapx + n - 1) / 8; i++)
+		use_tile(map_tile[m][(r * 32) + (i & 0x1F)]);
+
+	if (first > n)
+		first = n;
+	memcpy(line + x, map_cache[m][mapy] + mapx, first);
+	memcpy(line + x + first, map_cache[m][mapy], n - first);
+}
+
+static void render_background(const struct scanline *sl)
+{
+	if (!get_bit(lcdc, 0)) {
+		memset(bg_line, 0, WIDTH);
+		return;
+	}
+	map_line(bg_line, 0, get_bit(lcdc, 3), sl->regs[LINE_SCX],
+		 ly + sl->regs[LINE_SCY]);
+}
+
+/* Screen X where the window starts on this line, WIDTH if it is hidden */
+int window_x(const struct scanline *sl)
+{
+	int x = sl->regs[LINE_WX] - 7;
+
+	if (!get_bit(sl->regs[LINE_LCDC], 5) || !get_bit(sl->regs[LINE_LCDC], 0))
+		return WIDTH;
+	if (sl->ly < sl->regs[LINE_WY] || x >= WIDTH)
+		return WIDTH;
+	return x;
+}
+
+static void render_window(const struct scanline *sl)
+{
+	int x = window_x(sl);
+	u8 mapx = 0;
+
+	if (x >= WIDTH)
+		return;
+
+	if (x < 0) {
+		mapx = -x;
+		x = 0;
+	}
+	map_line(bg_line, x, get_bit(lcdc, 6), mapx, sl->regs[LINE_WINDOW]);
+}
+
+static void update_palette(const struct scanline *sl)
+{
+	u8 bgp_data = sl->regs[LINE_BGP];
+	u8 obj_data_0 = sl->regs[LINE_OBP0];
+	u8 obj_data_1 = sl->regs[LINE_OBP1];
+
+	bg_palette[0] = bgp_data & 0x3;
+	bg_palette[1] = (bgp_data >> 2) & 0x3;
+	bg_palette[2] = (bgp_data >> 4) & 0x3;
+	bg_palette[3] = (bgp_data >> 6) & 0x3;
+
+	obj_palette[0] = obj_data_0 & 0x3;
+	obj_palette[1] = (obj_data_0 >> 2) & 0x3;
+	obj_palette[2] = (obj_data_0 >> 4) & 0x3;
+	obj_palette[3] = (obj_data_0 >> 6) & 0x3;
+
+	obj_palette[4] = obj_data_1 & 0x3;
+	obj_palette[5] = (obj_data_1 >> 2) & 0x3;
+	obj_palette[6] = (obj_data_1 >> 4) & 0x3;
+	obj_palette[7] = (obj_data_1 >> 6) & 0x3;
+}
+
+static int line_clean(const struct line_state *ls, const struct scanline *sl)
+{
+	int i;
+
+	if (ls->frame + 1 != frame_count)
+		return 0;
+	if (memcmp(ls->regs, sl->regs, LINE_REGS))
+		return 0;
+	if (ls->spr_count != sl->spr_count ||
+	    memcmp(ls->spr, sl->spr, sl->spr_count * sizeof(struct sprite)))
+		return 0;
+	if (ls->map_rows & (map_rows_written[0] | map_rows_written[1]))
+		return 0;
+	for (i = 0; i < TILE_COUNT / 64; i++)
+		if (ls->tiles[i] & (tiles_written[0][i] | tiles_written[1][i]))
+			return 0;
+	return 1;
+}
+
+void render_line(const struct scanline *sl)
+{
+	struct line_state *ls = &lines[sl->ly];
+
+	if (!vram)
+		vram = get_vram();
+
+	lcdc = sl->regs[LINE_LCDC];
+	ly = sl->ly;
+	spr_height = (get_bit(lcdc, 2)) ? 16 : 8;
+
+	if (!line_clean(ls, sl)) {
+		memset(ls->tiles, 0, sizeof(ls->tiles));
+		ls->map_rows = 0;
+
+		update_palette(sl);
+		update_tile_cache();
+		if (get_bit(lcdc, 4) != tile_mode) {
+			tile_mode = get_bit(lcdc, 4);
+			vram_gen++;
+		}
+		render_background(sl);
+		render_window(sl);
+		render_sprites(sl);
+
+		compose_line(frame[ly], bg_line, obj_color, obj_flags,
+			     bg_palette, obj_palette);
+
+		memcpy(ls->regs, sl->regs, LINE_REGS);
+		memcpy(ls->spr, sl->spr, sl->spr_count * sizeof(struct sprite));
+		ls->spr_count = sl->spr_count;
+		frame_changed = 1;
+	}
+	ls->frame = frame_count;
+}
+
+/* End of frame, returns whether any line was drawn again */
+int render_frame_done(void)
+{
+	int changed = frame_changed;
+
+	memcpy(tiles_written[0], tiles_written[1], sizeof(tiles_written[0]));
+	memset(tiles_written[1], 0, sizeof(tiles_written[1]));
+	map_rows_written[0] = map_rows_written[1];
+	map_rows_written[1] = 0;
+	frame_changed = 0;
+	frame_count++;
+
+	return changed;
+}
+
+/*
+ * VRAM was replaced as a whole, e.g. by loading a state. Decode every tile
+ * again and draw every line from scratch. This may happen in the middle of
+ * a frame, so the lines get a frame number that is never the previous one,
+ * neither for the rest of this frame nor for the next.
+ */
+void render_invalidate(void)
+{
+	int i;
+
+	memset(tile_dirty, 0xFF, sizeof(tile_dirty));
+	tiles_dirty = 1;
+	vram_gen++;
+	for (i = 0; i < HEIGHT; i++)
+		lines[i].frame = frame_count - 2;
+}
+
+const u8 *render_frame(void)
+{
+	return frame[0];
+}
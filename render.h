@@ -0,0 +1,48 @@
+#ifndef RENDER_H
+#define RENDER_H
+#define MAX_SPRITES 10
+
+struct sprite {
+	u8 y;
+	u8 x;
+	u8 tilenr;
+	u8 flags;
+	int addr;
+};
+
+/* Registers a line depends on, as seen at the end of mode 3 */
+enum {
+	LINE_LCDC,
+	LINE_SCY,
+	LINE_SCX,
+	LINE_WY,
+	LINE_WX,
+	LINE_BGP,
+	LINE_OBP0,
+	LINE_OBP1,
+	LINE_WINDOW,
+	LINE_REGS
+};
+
+/* Everything needed to draw one line without looking at the CPU side */
+struct scanline {
+	u8 ly;
+	u8 regs[LINE_REGS];
+	int spr_count;
+	struct sprite spr[MAX_SPRITES];
+};
+
+void set_render_vram(const u8 *vram);
+
+void render_vram_write(u16 offset);
+
+int window_x(const struct scanline *sl);
+
+void render_line(const struct scanline *sl);
+
+int render_frame_done(void);
+
+void render_invalidate(void);
+
+const u8 *render_frame(void);
+#endif
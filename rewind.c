@@ -0,0 +1,270 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "gameboy.h"
+
+#include "rewind.h"
+#include "state.h"
+
+/* Runs of at least this many unchanged bytes end a literal */
+#define MIN_RUN 4
+#define MAX_LEN 0xFFFF
+
+/*
+ * Rewind. Every nth frame the whole state is captured and the previous
+ * capture is stored as the XOR against it, run length encoded, in a ring
+ * of 'budget' bytes. Only the newest state is kept in full and every
+ * delta leads one capture back, so stepping back decodes a single delta
+ * and the oldest delta can be dropped for free once the ring is full.
+ *
+ * A delta is a sequence of a 16 bit count of unchanged bytes, a 16 bit
+ * count of changed ones and the changed bytes XORed. In the ring every
+ * delta has its length in front and behind it so the newest one can be
+ * found from the end.
+ */
+static u8 *ring;
+static size_t ring_size;
+static u64 head;
+static u64 tail;
+
+static int every;
+static int frames;
+static int rewinding;
+
+static size_t state_len;
+static u8 *cur;
+static u8 *next;
+static u8 *delta;
+static int have_state;
+
+static u64 captures;
+static u64 raw_bytes;
+static u64 delta_bytes;
+static u64 capture_ns;
+static u64 steps;
+static u64 dropped;
+
+static void put16(u8 *p, u32 v)
+{
+	p[0] = v;
+	p[1] = v >> 8;
+}
+
+static u32 get16(const u8 *p)
+{
+	return p[0] | p[1] << 8;
+}
+
+static int same_run(const u8 *a, const u8 *b, size_t pos)
+{
+	return pos + MIN_RUN <= state_len && !memcmp(a + pos, b + pos, MIN_RUN);
+}
+
+/* Encode a ^ b into delta, returns the length */
+static size_t encode(const u8 *a, const u8 *b)
+{
+	size_t pos = 0, len = 0, start;
+	u64 x, y;
+	u32 n;
+
+	while (pos < state_len) {
+		start = pos;
+		while (pos + 8 <= state_len && pos - start + 8 <= MAX_LEN) {
+			memcpy(&x, a + pos, 8);
+			memcpy(&y, b + pos, 8);
+			if (x != y)
+				break;
+			pos += 8;
+		}
+		while (pos < state_len && pos - start < MAX_LEN && a[pos] == b[pos])
+			pos++;
+		put16(delta + len, pos - start);
+		len += 4;
+
+		for (n = 0; pos < state_len && n < MAX_LEN; n++, pos++) {
+			if (a[pos] == b[pos] && same_run(a, b, pos))
+				break;
+			delta[len + n] = a[pos] ^ b[pos];
+		}
+		put16(delta + len - 2, n);
+		len += n;
+	}
+	return len;
+}
+
+/* XOR a delta into s */
+static void decode(u8 *s, const u8 *d, size_t len)
+{
+	size_t pos = 0, i = 0;
+	u32 n;
+
+	while (i < len) {
+		pos += get16(d + i);
+		n = get16(d + i + 2);
+		i += 4;
+		while (n--)
+			s[pos++] ^= d[i++];
+	}
+}
+
+static void ring_write(u64 at, const void *data, size_t n)
+{
+	size_t off = at % ring_size, first = ring_size - off;
+
+	if (first > n)
+		first = n;
+	memcpy(ring + off, data, first);
+	memcpy(ring, (const u8 *) data + first, n - first);
+}
+
+static void ring_read(u64 at, void *data, size_t n)
+{
+	size_t off = at % ring_size, first = ring_size - off;
+
+	if (first > n)
+		first = n;
+	memcpy(data, ring + off, first);
+	memcpy((u8 *) data + first, ring, n - first);
+}
+
+/*
+ * A delta bigger than the whole ring can't be kept, and the older ones no
+ * longer lead back from the new capture without it, so they go as well.
+ */
+static void push_delta(size_t len)
+{
+	u32 n = len, old;
+
+	if (len + 8 > ring_size) {
+		tail = head;
+		dropped++;
+		return;
+	}
+	while (ring_size - (head - tail) < len + 8) {
+		ring_read(tail, &old, 4);
+		tail += old + 8;
+	}
+	ring_write(head, &n, 4);
+	ring_write(head + 4, delta, len);
+	ring_write(head + 4 + len, &n, 4);
+	head += len + 8;
+}
+
+static size_t pop_delta(void)
+{
+	u32 n;
+
+	ring_read(head - 4, &n, 4);
+	head -= n + 8;
+	ring_read(head + 4, delta, n);
+	return n;
+}
+
+/*
+ * Keep 'budget' bytes of deltas, capturing every nth frame. Needs the ROM
+ * loaded, returns -1 if out of memory.
+ */
+int init_rewind(size_t budget, int n)
+{
+	state_len = state_size();
+	ring_size = budget;
+	every = n;
+
+	ring = malloc(ring_size);
+	cur = malloc(state_len);
+	next = malloc(state_len);
+	/* Worst case, a literal for every MAX_LEN bytes */
+	delta = malloc(state_len + 4 * (state_len / MAX_LEN + 1));
+	if (!ring || !cur || !next || !delta)
+		return -1;
+	return 0;
+}
+
+/* Step back while 'on', called on the emulation thread */
+void set_rewinding(int on)
+{
+	rewinding = on;
+}
+
+static void capture(void)
+{
+	u64 start = time_ns();
+	u8 *t;
+	size_t len;
+
+	save_state(next);
+	if (have_state) {
+		len = encode(cur, next);
+		push_delta(len);
+		delta_bytes += len;
+		raw_bytes += state_len;
+	}
+	t = cur;
+	cur = next;
+	next = t;
+	have_state = 1;
+
+	captures++;
+	capture_ns += time_ns() - start;
+}
+
+/* Called on every VBlank */
+void rewind_frame(void)
+{
+	if (!ring)
+		return;
+
+	if (rewinding) {
+		step_back();
+		return;
+	}
+	if (++frames >= every) {
+		frames = 0;
+		capture();
+	}
+}
+
+/*
+ * Go back to the capture before the newest one. Returns -1 and stays at
+ * the oldest capture when there is nothing older.
+ */
+int step_back(void)
+{
+	int ret = -1;
+
+	if (!have_state)
+		return -1;
+
+	if (head != tail) {
+		decode(cur, delta, pop_delta());
+		steps++;
+		ret = 0;
+	}
+	load_state(cur);
+	frames = 0;
+	return ret;
+}
+
+void close_rewind(void)
+{
+	if (!ring)
+		return;
+
+	if (captures)
+		fprintf(stderr, "rewind: %lu captures, %lu KB in %lu KB "
+			"(%.1f:1), %.1f us per capture, %lu steps back, "
+			"%lu too big for the ring\n",
+			(unsigned long) captures,
+			(unsigned long) (raw_bytes / 1024),
+			(unsigned long) (delta_bytes / 1024),
+			delta_bytes ? (double) raw_bytes / delta_bytes : 0.0,
+			capture_ns / 1000.0 / captures,
+			(unsigned long) steps, (unsigned long) dropped);
+
+	free(ring);
+	free(cur);
+	free(next);
+	free(delta);
+	ring = NULL;
+}
@@ -0,0 +1,15 @@
+#ifndef REWIND_H
+#define REWIND_H
+/* Default frames between captures */
+#define REWIND_EVERY 2
+
+int init_rewind(size_t budget, int every);
+
+void set_rewinding(int on);
+
+void rewind_frame(void);
+
+int step_back(void);
+
+void close_rewind(void);
+#endif
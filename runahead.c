@@ -0,0 +1,107 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "gameboy.h"
+
+#include "cpu.h"
+#include "runahead.h"
+#include "state.h"
+#include "timer.h"
+#include "video.h"
+
+/*
+ * Run-ahead. After every drawn frame the machine is saved, emulated
+ * 'ahead' frames further with the buttons held now, and restored. The last
+ * of those frames is shown instead, which hides that many frames of the
+ * game's own input lag, as long as the game only reads the joypad once
+ * per frame. The frames in between are thrown away.
+ */
+static int ahead;
+static u8 *saved;
+static u8 *schedule;
+static u8 frame[WIDTH * HEIGHT];
+
+static u64 runs;
+static u64 run_ns;
+
+/* Returns -1 if out of memory, needs the ROM loaded */
+int init_run_ahead(int frames)
+{
+	struct state s = { STATE_SIZE, NULL, 0 };
+
+	frame_schedule_state(&s);
+	ahead = frames;
+	saved = malloc(state_size());
+	schedule = malloc(s.pos);
+	return saved && schedule ? 0 : -1;
+}
+
+static void schedule_state(enum state_mode mode)
+{
+	struct state s = { STATE_SAVE, NULL, 0 };
+
+	s.mode = mode;
+	s.buf = schedule;
+	frame_schedule_state(&s);
+}
+
+int run_ahead_enabled(void)
+{
+	return saved != NULL;
+}
+
+/*
+ * Called right after draw() returned a frame, before the instruction it
+ * belongs to runs. While the LCD is off a frame ends after FRAME_CYCLES.
+ */
+static void emulate_frame(void)
+{
+	int ret, cycles = 0;
+
+	do {
+		fetch_opcode();
+		update_timer();
+		ret = draw();
+		cycles += cpu_cycle() - old_cpu_cycle();
+	} while (!(ret & LCD_VBLANK) && cycles < FRAME_CYCLES);
+}
+
+/*
+ * The frame 'ahead' frames from now. Frame skipping and on demand frames
+ * go on from where they were, the last frame ahead is always drawn.
+ */
+const u8 *run_ahead(void)
+{
+	u64 start = time_ns();
+	int i;
+
+	save_state(saved);
+	schedule_state(STATE_SAVE);
+	for (i = 0; i < ahead; i++) {
+		if (i == ahead - 1)
+			draw_next_frame();
+		emulate_frame();
+	}
+	memcpy(frame, get_frame(), sizeof(frame));
+	load_state(saved);
+	schedule_state(STATE_LOAD);
+
+	runs++;
+	run_ns += time_ns() - start;
+	return frame;
+}
+
+void close_run_ahead(void)
+{
+	if (!saved)
+		return;
+
+	if (runs)
+		fprintf(stderr, "run-ahead: %d frames, %.1f us per frame "
+			"(%.1f%% of a frame)\n", ahead, run_ns / 1000.0 / runs,
+			100.0 * run_ns / runs / FRAME_NS);
+	free(saved);
+	free(schedule);
+	saved = NULL;
+}
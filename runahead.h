@@ -0,0 +1,12 @@
+#ifndef RUNAHEAD_H
+#define RUNAHEAD_H
+#define MAX_RUN_AHEAD 8
+
+int init_run_ahead(int frames);
+
+int run_ahead_enabled(void);
+
+const u8 *run_ahead(void);
+
+void close_run_ahead(void);
+#endif
@@ -0,0 +1,374 @@
+#include <stdio.h>
+#include <string.h>
+
+#include "gameboy.h"
+
+#include "scale.h"
+#include "video.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#define HAVE_X86_SIMD
+#include <immintrin.h>
+#endif
+
+/*
+ * Software scalers over 32 bit host pixels. Like the compose kernels
+ * every kernel has a scalar version and SSSE3 and AVX2 versions on x86,
+ * picked at runtime by init_scale().
+ *
+ * scale_row: repeat every pixel of a row 'f' times.
+ * scale2x_rows: the two output rows of a row for the scale2x (EPX)
+ * filter. 'prev', 'cur' and 'next' have one extra pixel on either side
+ * that repeats the edge. With 'smooth' set, the corners scale2x would
+ * replace are blended half way instead, which rounds off the stairs
+ * similar to hq2x at a fraction of the cost.
+ */
+struct scale_impl {
+	const char *name;
+	void (*scale_row)(u32 *, const u32 *, int, int);
+	void (*scale2x_rows)(u32 *, u32 *, const u32 *, const u32 *,
+			     const u32 *, int, int);
+};
+
+static void scale_row_scalar(u32 *dst, const u32 *src, int n, int f)
+{
+	int i, k;
+
+	for (i = 0; i < n; i++)
+		for (k = 0; k < f; k++)
+			*dst++ = src[i];
+}
+
+/* Per byte average rounding up, as _mm_avg_epu8 */
+static u32 blend(u32 a, u32 b)
+{
+	return (a | b) - (((a ^ b) >> 1) & 0x7F7F7F7F);
+}
+
+static void scale2x_rows_scalar(u32 *dst0, u32 *dst1, const u32 *prev,
+				const u32 *cur, const u32 *next, int n,
+				int smooth)
+{
+	u32 b, d, e, f, h, dd, ff;
+	int i;
+
+	for (i = 0; i < n; i++) {
+		b = prev[i + 1];
+		d = cur[i];
+		e = cur[i + 1];
+		f = cur[i + 2];
+		h = next[i + 1];
+		dd = smooth ? blend(d, e) : d;
+		ff = smooth ? blend(f, e) : f;
+
+		dst0[2 * i] = (d == b && b != f && d != h) ? dd : e;
+		dst0[2 * i + 1] = (b == f && b != d && f != h) ? ff : e;
+		dst1[2 * i] = (d == h && d != b && h != f) ? dd : e;
+		dst1[2 * i + 1] = (h == f && d != h && b != f) ? ff : e;
+	}
+}
+
+static const struct scale_impl scalar_impl = {
+	"scalar",
+	scale_row_scalar,
+	scale2x_rows_scalar
+};
+
+static const struct scale_impl *impl = &scalar_impl;
+
+/*
+ * Source index of every output lane for a factor 'f', relative to the
+ * first source pixel of the output chunk. A chunk that starts 'r' output
+ * pixels into a source pixel uses row [f - 1][r].
+ */
+static u8 lane_src[MAX_SCALE][MAX_SCALE][8];
+
+static void init_lane_src(void)
+{
+	int f, r, l;
+
+	for (f = 1; f <= MAX_SCALE; f++)
+		for (r = 0; r < f; r++)
+			for (l = 0; l < 8; l++)
+				lane_src[f - 1][r][l] = (r + l) / f;
+}
+
+#ifdef HAVE_X86_SIMD
+#define SSSE3 __attribute__((target("ssse3")))
+#define AVX2 __attribute__((target("avx2")))
+
+/* Each chunk of 4 output pixels is a byte shuffle of 4 source pixels */
+SSSE3 static void scale_row_ssse3(u32 *dst, const u32 *src, int n, int f)
+{
+	u8 mask[MAX_SCALE][16];
+	int i, j, r, base, out = n * f;
+
+	for (r = 0; r < f; r++)
+		for (i = 0; i < 16; i++)
+			mask[r][i] = 4 * lane_src[f - 1][r][i / 4] + (i & 3);
+
+	base = 0;
+	r = 0;
+	for (j = 0; j + 4 <= out && base + 4 <= n; j += 4) {
+		_mm_storeu_si128((__m128i *) (dst + j), _mm_shuffle_epi8(
+			_mm_loadu_si128((const __m128i *) (src + base)),
+			_mm_loadu_si128((const __m128i *) mask[r])));
+		for (r += 4; r >= f; r -= f)
+			base++;
+	}
+	for (; j < out; j++)
+		dst[j] = src[j / f];
+}
+
+SSSE3 static void scale2x_rows_ssse3(u32 *dst0, u32 *dst1, const u32 *prev,
+				     const u32 *cur, const u32 *next, int n,
+				     int smooth)
+{
+	__m128i b, d, e, f, h, dd, ff, bd, bf, dh, fh, e0, e1, e2, e3;
+	int i;
+
+	for (i = 0; i + 4 <= n; i += 4) {
+		b = _mm_loadu_si128((const __m128i *) (prev + i + 1));
+		d = _mm_loadu_si128((const __m128i *) (cur + i));
+		e = _mm_loadu_si128((const __m128i *) (cur + i + 1));
+		f = _mm_loadu_si128((const __m128i *) (cur + i + 2));
+		h = _mm_loadu_si128((const __m128i *) (next + i + 1));
+		dd = smooth ? _mm_avg_epu8(d, e) : d;
+		ff = smooth ? _mm_avg_epu8(f, e) : f;
+
+		bd = _mm_cmpeq_epi32(b, d);
+		bf = _mm_cmpeq_epi32(b, f);
+		dh = _mm_cmpeq_epi32(d, h);
+		fh = _mm_cmpeq_epi32(f, h);
+
+		e0 = _mm_andnot_si128(_mm_or_si128(bf, dh), bd);
+		e1 = _mm_andnot_si128(_mm_or_si128(bd, fh), bf);
+		e2 = _mm_andnot_si128(_mm_or_si128(bd, fh), dh);
+		e3 = _mm_andnot_si128(_mm_or_si128(dh, bf), fh);
+
+		e0 = _mm_or_si128(_mm_and_si128(e0, dd), _mm_andnot_si128(e0, e));
+		e1 = _mm_or_si128(_mm_and_si128(e1, ff), _mm_andnot_si128(e1, e));
+		e2 = _mm_or_si128(_mm_and_si128(e2, dd), _mm_andnot_si128(e2, e));
+		e3 = _mm_or_si128(_mm_and_si128(e3, ff), _mm_andnot_si128(e3, e));
+
+		_mm_storeu_si128((__m128i *) (dst0 + 2 * i), _mm_unpacklo_epi32(e0, e1));
+		_mm_storeu_si128((__m128i *) (dst0 + 2 * i + 4), _mm_unpackhi_epi32(e0, e1));
+		_mm_storeu_si128((__m128i *) (dst1 + 2 * i), _mm_unpacklo_epi32(e2, e3));
+		_mm_storeu_si128((__m128i *) (dst1 + 2 * i + 4), _mm_unpackhi_epi32(e2, e3));
+	}
+	scale2x_rows_scalar(dst0 + 2 * i, dst1 + 2 * i, prev + i, cur + i,
+			    next + i, n - i, smooth);
+}
+
+static const struct scale_impl ssse3_impl = {
+	"ssse3",
+	scale_row_ssse3,
+	scale2x_rows_ssse3
+};
+
+/* Each chunk of 8 output pixels is a lane permute of 8 source pixels */
+AVX2 static void scale_row_avx2(u32 *dst, const u32 *src, int n, int f)
+{
+	__m256i idx[MAX_SCALE];
+	int j, r, base, out = n * f;
+
+	for (r = 0; r < f; r++)
+		idx[r] = _mm256_cvtepu8_epi32(
+			_mm_loadl_epi64((const __m128i *) lane_src[f - 1][r]));
+
+	base = 0;
+	r = 0;
+	for (j = 0; j + 8 <= out && base + 8 <= n; j += 8) {
+		_mm256_storeu_si256((__m256i *) (dst + j),
+			_mm256_permutevar8x32_epi32(
+				_mm256_loadu_si256((const __m256i *) (src + base)),
+				idx[r]));
+		for (r += 8; r >= f; r -= f)
+			base++;
+	}
+	for (; j < out; j++)
+		dst[j] = src[j / f];
+}
+
+AVX2 static void scale2x_rows_avx2(u32 *dst0, u32 *dst1, const u32 *prev,
+				   const u32 *cur, const u32 *next, int n,
+				   int smooth)
+{
+	__m256i b, d, e, f, h, dd, ff, bd, bf, dh, fh, e0, e1, e2, e3, lo, hi;
+	int i;
+
+	for (i = 0; i + 8 <= n; i += 8) {
+		b = _mm256_loadu_si256((const __m256i *) (prev + i + 1));
+		d = _mm256_loadu_si256((const __m256i *) (cur + i));
+		e = _mm256_loadu_si256((const __m256i *) (cur + i + 1));
+		f = _mm256_loadu_si256((const __m256i *) (cur + i + 2));
+		h = _mm256_loadu_si256((const __m256i *) (next + i + 1));
+		dd = smooth ? _mm256_avg_epu8(d, e) : d;
+		ff = smooth ? _mm256_avg_epu8(f, e) : f;
+
+		bd = _mm256_cmpeq_epi32(b, d);
+		bf = _mm256_cmpeq_epi32(b, f);
+		dh = _mm256_cmpeq_epi32(d, h);
+		fh = _mm256_cmpeq_epi32(f, h);
+
+		e0 = _mm256_andnot_si256(_mm256_or_si256(bf, dh), bd);
+		e1 = _mm256_andnot_si256(_mm256_or_si256(bd, fh), bf);
+		e2 = _mm256_andnot_si256(_mm256_or_si256(bd, fh), dh);
+		e3 = _mm256_andnot_si256(_mm256_or_si256(dh, bf), fh);
+
+		e0 = _mm256_blendv_epi8(e, dd, e0);
+		e1 = _mm256_blendv_epi8(e, ff, e1);
+		e2 = _mm256_blendv_epi8(e, dd, e2);
+		e3 = _mm256_blendv_epi8(e, ff, e3);
+
+		/* Unpacking works within 128 bit lanes, put the halves in order */
+		lo = _mm256_unpacklo_epi32(e0, e1);
+		hi = _mm256_unpackhi_epi32(e0, e1);
+		_mm256_storeu_si256((__m256i *) (dst0 + 2 * i),
+				    _mm256_permute2x128_si256(lo, hi, 0x20));
+		_mm256_storeu_si256((__m256i *) (dst0 + 2 * i + 8),
+				    _mm256_permute2x128_si256(lo, hi, 0x31));
+		lo = _mm256_unpacklo_epi32(e2, e3);
+		hi = _mm256_unpackhi_epi32(e2, e3);
+		_mm256_storeu_si256((__m256i *) (dst1 + 2 * i),
+				    _mm256_permute2x128_si256(lo, hi, 0x20));
+		_mm256_storeu_si256((__m256i *) (dst1 + 2 * i + 8),
+				    _mm256_permute2x128_si256(lo, hi, 0x31));
+	}
+	scale2x_rows_scalar(dst0 + 2 * i, dst1 + 2 * i, prev + i, cur + i,
+			    next + i, n - i, smooth);
+}
+
+static const struct scale_impl avx2_impl = {
+	"avx2",
+	scale_row_avx2,
+	scale2x_rows_avx2
+};
+#endif
+
+void init_scale(void)
+{
+	init_lane_src();
+#ifdef HAVE_X86_SIMD
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2"))
+		impl = &avx2_impl;
+	else if (__builtin_cpu_supports("ssse3"))
+		impl = &ssse3_impl;
+#endif
+}
+
+const char *scale_name(void)
+{
+	return impl->name;
+}
+
+/* Copy a row with the edge pixels repeated on either side */
+static void pad_row(u32 *dst, const u32 *src, int n)
+{
+	dst[0] = src[0];
+	memcpy(dst + 1, src, n * sizeof(u32));
+	dst[n + 1] = src[n - 1];
+}
+
+static void scale2x(u32 *dst, const u32 *src, int w, int h, int smooth)
+{
+	u32 rows[3][WIDTH + 2];
+	u32 *prev = rows[0], *cur = rows[1], *next = rows[2], *tmp;
+	int y;
+
+	pad_row(cur, src, w);
+	memcpy(prev, cur, (w + 2) * sizeof(u32));
+	for (y = 0; y < h; y++) {
+		pad_row(next, src + (y + 1 < h ? y + 1 : y) * w, w);
+		impl->scale2x_rows(dst + 2 * y * 2 * w, dst + (2 * y + 1) * 2 * w,
+				   prev, cur, next, w, smooth);
+		tmp = prev;
+		prev = cur;
+		cur = next;
+		next = tmp;
+	}
+}
+
+static void scale_nearest(u32 *dst, const u32 *src, int w, int h, int f)
+{
+	int y, k, out = w * f;
+
+	for (y = 0; y < h; y++) {
+		impl->scale_row(dst, src + y * w, w, f);
+		for (k = 1; k < f; k++)
+			memcpy(dst + k * out, dst, out * sizeof(u32));
+		dst += f * out;
+	}
+}
+
+/*
+ * Scale a WIDTH x HEIGHT frame by 'factor' (1 - 8). The filters work at
+ * 2x and larger even factors scale their output up further, odd factors
+ * are scaled without a filter.
+ */
+void scale_frame(u32 *dst, const u32 *src, int factor,
+		 enum scale_filter filter)
+{
+	static u32 doubled[2 * WIDTH * 2 * HEIGHT];
+
+	if (filter == FILTER_NONE || factor % 2) {
+		scale_nearest(dst, src, WIDTH, HEIGHT, factor);
+	} else if (factor == 2) {
+		scale2x(dst, src, WIDTH, HEIGHT, filter == FILTER_SMOOTH);
+	} else {
+		scale2x(doubled, src, WIDTH, HEIGHT, filter == FILTER_SMOOTH);
+		scale_nearest(dst, doubled, 2 * WIDTH, 2 * HEIGHT, factor / 2);
+	}
+}
+
+/*
+ * Time every factor and filter with every kernel set the CPU supports,
+ * the best of 5 runs is reported.
+ */
+void bench_scale(void)
+{
+	static const struct scale_impl *impls[3];
+	static const char *filters[] = { "none", "scale2x", "smooth" };
+	static u32 src[WIDTH * HEIGHT];
+	static u32 dst[MAX_SCALE * WIDTH * MAX_SCALE * HEIGHT];
+	const struct scale_impl *best;
+	int nimpl = 0, i, f, filter, n, run, frames = 50;
+	u64 start, ns, best_ns;
+
+	init_scale();
+	best = impl;
+	impls[nimpl++] = &scalar_impl;
+#ifdef HAVE_X86_SIMD
+	if (__builtin_cpu_supports("ssse3"))
+		impls[nimpl++] = &ssse3_impl;
+	if (__builtin_cpu_supports("avx2"))
+		impls[nimpl++] = &avx2_impl;
+#endif
+
+	for (i = 0; i < WIDTH * HEIGHT; i++)
+		src[i] = 0xFF000000 | (((i * 7) ^ (i / WIDTH)) % 4) * 0x555555;
+
+	printf("%-8s %-6s %-8s %12s\n", "kernel", "scale", "filter", "us/frame");
+	for (i = 0; i < nimpl; i++) {
+		impl = impls[i];
+		for (filter = FILTER_NONE; filter <= FILTER_SMOOTH; filter++) {
+			for (f = 2; f <= MAX_SCALE; f++) {
+				if (filter != FILTER_NONE && f % 2)
+					continue;
+				best_ns = 0;
+				for (run = 0; run < 5; run++) {
+					start = time_ns();
+					for (n = 0; n < frames; n++)
+						scale_frame(dst, src, f, filter);
+					ns = time_ns() - start;
+					if (!best_ns || ns < best_ns)
+						best_ns = ns;
+				}
+				printf("%-8s %-6d %-8s %12.1f\n", impl->name, f,
+				       filters[filter], best_ns / 1000.0 / frames);
+			}
+		}
+	}
+	impl = best;
+}
@@ -0,0 +1,19 @@
+#ifndef SCALE_H
+#define SCALE_H
+#define MAX_SCALE 8
+
+enum scale_filter {
+	FILTER_NONE,
+	FILTER_SCALE2X,
+	FILTER_SMOOTH
+};
+
+void init_scale(void);
+
+const char *scale_name(void);
+
+void scale_frame(u32 *dst, const u32 *src, int factor,
+		 enum scale_filter filter);
+
+void bench_scale(void);
+#endif
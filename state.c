@@ -0,0 +1,571 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "gameboy.h"
+
+#include "boot.h"
+#include "cpu.h"
+#include "hash.h"
+#include "interrupt.h"
+#include "memory.h"
+#include "state.h"
+#include "timer.h"
+#include "video.h"
+
+/*
+ * In-memory save states: a flat copy of the CPU, memory, PPU, timer and
+ * interrupt state without the ROM. A state is only valid for the ROM and
+ * the build it was saved with.
+ */
+void state_bytes(struct state *s, void *data, size_t n)
+{
+	if (s->mode == STATE_SAVE)
+		memcpy(s->buf + s->pos, data, n);
+	else if (s->mode == STATE_LOAD)
+		memcpy(data, s->buf + s->pos, n);
+	s->pos += n;
+}
+
+/*
+ * Every part of the machine with the id of its section in a state file.
+ * The RAM pages go first so the PPU reloads its caches from the new VRAM.
+ * Sections that are not part of the emulated machine only matter for what
+ * is drawn and may differ between hosts running the same game.
+ */
+static const struct section {
+	u32 id;
+	void (*state)(struct state *s);
+	int machine;
+} sections[] = {
+	{ SECTION_RAM, ram_state, 1 },
+	{ SECTION_CPU, cpu_state, 1 },
+	{ SECTION_MEMORY, memory_state, 1 },
+	{ SECTION_MBC, mbc_state, 1 },
+	{ SECTION_PPU, video_state, 1 },
+	{ SECTION_TIMER, timer_state, 1 },
+	{ SECTION_INTERRUPT, interrupt_state, 1 },
+	{ SECTION_SCANLINE, scanline_state, 0 }
+};
+
+#define N_SECTIONS (sizeof(sections) / sizeof(sections[0]))
+
+/* Everything but the RAM pages */
+static void core_state(struct state *s)
+{
+	size_t i;
+
+	for (i = 1; i < N_SECTIONS; i++)
+		sections[i].state(s);
+}
+
+static void machine_state(struct state *s)
+{
+	size_t i;
+
+	for (i = 0; i < N_SECTIONS; i++)
+		sections[i].state(s);
+}
+
+/* Size of a state for the loaded ROM */
+size_t state_size(void)
+{
+	struct state s = { STATE_SIZE, NULL, 0 };
+
+	machine_state(&s);
+	return s.pos;
+}
+
+void save_state(u8 *buf)
+{
+	struct state s = { STATE_SAVE, NULL, 0 };
+
+	s.buf = buf;
+	machine_state(&s);
+}
+
+void load_state(const u8 *buf)
+{
+	struct state s = { STATE_LOAD, NULL, 0 };
+
+	s.buf = (u8 *) buf;
+	machine_state(&s);
+	cancel_boot_cache();
+}
+
+/*
+ * Save only the emulated machine, to compare runs whatever the host drew.
+ * Needs state_size() bytes at most, returns the size.
+ */
+size_t save_machine(u8 *buf)
+{
+	struct state s = { STATE_SAVE, NULL, 0 };
+	size_t i;
+
+	s.buf = buf;
+	for (i = 0; i < N_SECTIONS; i++)
+		if (sections[i].machine)
+			sections[i].state(&s);
+	return s.pos;
+}
+
+/*
+ * Incremental snapshots. Each snapshot holds the core state and only the
+ * RAM pages written since its parent, the last snapshot taken or restored,
+ * so a checkpoint costs what the game changed. A snapshot without a parent
+ * holds every page. Restoring writes back the pages written since the
+ * last snapshot and those that differ along the way to the target in the
+ * snapshot tree, each from the nearest snapshot up the chain that has it.
+ */
+struct snapshot {
+	struct snapshot *parent;
+	int children;
+	int depth;
+	u64 pages[PAGE_WORDS];
+	size_t core;
+	u8 data[];
+};
+
+/* Pages of an 8 KB bank, no RAM region crosses a multiple of it */
+#define BANK_PAGES (0x2000 / PAGE_BYTES)
+
+static struct snapshot *current;
+static struct snapshot *reset_point;
+
+static int has_page(const u64 *pages, int nr)
+{
+	return pages[nr / 64] >> (nr % 64) & 1;
+}
+
+/* The next page in 'pages' from 'nr' on, or RAM_PAGES */
+static int next_page(const u64 *pages, int nr)
+{
+	u64 w;
+
+	while (nr < RAM_PAGES) {
+		w = pages[nr / 64] >> (nr % 64);
+		if (w)
+			return nr + __builtin_ctzll(w);
+		nr = (nr / 64 + 1) * 64;
+	}
+	return RAM_PAGES;
+}
+
+static int count_pages(const u64 *pages)
+{
+	int i, n = 0;
+
+	for (i = 0; i < PAGE_WORDS; i++)
+		n += __builtin_popcountll(pages[i]);
+	return n;
+}
+
+/* Where page 'nr' of 'snap' is stored, the page must be in the snapshot */
+static u8 *page_data(const struct snapshot *snap, int nr)
+{
+	int i, slot = 0;
+
+	for (i = 0; i < nr / 64; i++)
+		slot += __builtin_popcountll(snap->pages[i]);
+	slot += __builtin_popcountll(snap->pages[nr / 64] &
+				     (((u64) 1 << (nr % 64)) - 1));
+	return (u8 *) snap->data + snap->core + slot * PAGE_BYTES;
+}
+
+/* The nearest snapshot up the chain that holds page 'nr' */
+static const struct snapshot *page_owner(const struct snapshot *snap, int nr)
+{
+	while (!has_page(snap->pages, nr))
+		snap = snap->parent;
+	return snap;
+}
+
+/* Pages that differ between two snapshots */
+static void diff_pages(const struct snapshot *a, const struct snapshot *b,
+		       u64 *pages)
+{
+	int i;
+
+	while (a != b) {
+		if (!a || !b) {
+			ram_pages(pages);
+			return;
+		}
+		if (a->depth >= b->depth) {
+			for (i = 0; i < PAGE_WORDS; i++)
+				pages[i] |= a->pages[i];
+			a = a->parent;
+		} else {
+			for (i = 0; i < PAGE_WORDS; i++)
+				pages[i] |= b->pages[i];
+			b = b->parent;
+		}
+	}
+}
+
+/* Returns NULL if out of memory */
+struct snapshot *take_snapshot(void)
+{
+	struct state s = { STATE_SIZE, NULL, 0 };
+	struct snapshot *snap;
+	u64 pages[PAGE_WORDS];
+	int i, n;
+
+	core_state(&s);
+	take_dirty_pages(pages);
+	if (!current)
+		ram_pages(pages);
+	n = count_pages(pages);
+
+	snap = malloc(sizeof(*snap) + s.pos + n * PAGE_BYTES);
+	if (!snap) {
+		mark_pages_dirty(pages);
+		return NULL;
+	}
+	snap->parent = current;
+	snap->children = 0;
+	snap->depth = current ? current->depth + 1 : 0;
+	if (current)
+		current->children++;
+	memcpy(snap->pages, pages, sizeof(pages));
+	snap->core = s.pos;
+
+	s.mode = STATE_SAVE;
+	s.buf = snap->data;
+	s.pos = 0;
+	core_state(&s);
+	for (i = next_page(pages, 0); i < RAM_PAGES; i = next_page(pages, i + 1))
+		memcpy(page_data(snap, i), ram_page(i), PAGE_BYTES);
+
+	current = snap;
+	return snap;
+}
+
+void restore_snapshot(struct snapshot *snap)
+{
+	struct state s = { STATE_LOAD, NULL, 0 };
+	const struct snapshot *owner;
+	u64 pages[PAGE_WORDS];
+	int i, n;
+
+	take_dirty_pages(pages);
+	diff_pages(current, snap, pages);
+
+	/* Neighbouring pages from the same snapshot are copied in one go */
+	for (i = next_page(pages, 0); i < RAM_PAGES; i = next_page(pages, i + n)) {
+		owner = page_owner(snap, i);
+		for (n = 1; (i + n) % BANK_PAGES && has_page(pages, i + n) &&
+			    page_owner(snap, i + n) == owner; n++)
+			;
+		load_pages(i, n, page_data(owner, i));
+	}
+
+	s.buf = snap->data;
+	core_state(&s);
+	current = snap;
+	cancel_boot_cache();
+}
+
+/*
+ * Make the current state the one reset() returns to, as a snapshot of its
+ * own that later snapshots build on. Snapshots taken on top of an earlier
+ * reset point have to be freed first. Returns -1 if they are not or if out
+ * of memory.
+ */
+int set_reset_point(void)
+{
+	struct snapshot *parent = current, *snap;
+
+	if (reset_point && reset_point->children)
+		return -1;
+
+	current = NULL;
+	snap = take_snapshot();
+	if (!snap) {
+		current = parent;
+		return -1;
+	}
+	if (reset_point)
+		free_snapshot(reset_point);
+	reset_point = snap;
+	return 0;
+}
+
+/*
+ * Back to the reset point, copying only the RAM pages written since and
+ * the few hundred bytes of registers and counters. The ROM and everything
+ * set up once, like the opcode tables, stay as they are. Returns -1 if
+ * there is no reset point.
+ */
+int reset(void)
+{
+	if (!reset_point)
+		return -1;
+	restore_snapshot(reset_point);
+	return 0;
+}
+
+static void run_cycles(u64 cycles)
+{
+	u64 end = elapsed_cycles() + cycles;
+
+	while (elapsed_cycles() < end) {
+		update_timer();
+		draw();
+		fetch_opcode();
+	}
+}
+
+/* Print how long reset() and a full load_state() take after some frames */
+void bench_reset(void)
+{
+	static const int frames[] = { 1, 10, 60, 600 };
+	u64 start, reset_ns, load_ns;
+	size_t i;
+	int run, runs = 100;
+	u8 *buf;
+
+	buf = malloc(state_size());
+	if (!buf || set_reset_point() != 0)
+		return;
+	save_state(buf);
+
+	printf("%-8s %12s %12s\n", "frames", "reset us", "load us");
+	for (i = 0; i < sizeof(frames) / sizeof(frames[0]); i++) {
+		reset_ns = load_ns = 0;
+		for (run = 0; run < runs; run++) {
+			run_cycles((u64) frames[i] * FRAME_CYCLES);
+			start = time_ns();
+			load_state(buf);
+			load_ns += time_ns() - start;
+		}
+		/* A full load leaves every page to be copied back once */
+		reset();
+		for (run = 0; run < runs; run++) {
+			run_cycles((u64) frames[i] * FRAME_CYCLES);
+			start = time_ns();
+			reset();
+			reset_ns += time_ns() - start;
+		}
+		printf("%-8d %12.2f %12.2f\n", frames[i],
+		       reset_ns / 1000.0 / runs, load_ns / 1000.0 / runs);
+	}
+	free(buf);
+}
+
+/* Bytes used by the snapshot itself, without its parents */
+size_t snapshot_size(const struct snapshot *snap)
+{
+	return sizeof(*snap) + snap->core + count_pages(snap->pages) * PAGE_BYTES;
+}
+
+/*
+ * Snapshots must be freed children first. Freeing the last snapshot makes
+ * the next one a full snapshot again.
+ */
+void free_snapshot(struct snapshot *snap)
+{
+	if (snap == current)
+		current = NULL;
+	if (snap->parent)
+		snap->parent->children--;
+	free(snap);
+}
+
+#define FILE_MAGIC "TMPGBSTA"
+#define FILE_VERSION 2
+#define SECTION_ALIGN 64
+
+/*
+ * State files. A header with the ROM's hash is followed by a table of
+ * sections and the sections themselves, each 64 byte aligned and holding
+ * exactly what the in-memory state holds for that part of the machine.
+ * Loading maps the file and copies every section straight into place.
+ *
+ * Sections a reader does not know are skipped, so new ones can be added
+ * without a new version, which is only bumped when an existing section
+ * changes. The header and the table are covered by a checksum, each
+ * section by its own hash. Like in-memory states they only carry over to
+ * builds with the same layout of the statics, on little endian hosts.
+ */
+struct file_header {
+	char magic[8];
+	u32 version;
+	u32 sections;
+	u64 rom;
+	u64 checksum;
+};
+
+struct file_section {
+	u32 id;
+	u32 reserved;
+	u64 offset;
+	u64 size;
+	u64 hash;
+};
+
+struct state_file {
+	void *map;
+	size_t len;
+	const u8 *data[N_SECTIONS];
+};
+
+static size_t section_size(const struct section *sec)
+{
+	struct state s = { STATE_SIZE, NULL, 0 };
+
+	sec->state(&s);
+	return s.pos;
+}
+
+static u64 header_checksum(const struct file_header *h,
+			   const struct file_section *table)
+{
+	struct file_header copy = *h;
+
+	copy.checksum = 0;
+	return hash64((const u8 *) table, h->sections * sizeof(*table),
+		      hash64((const u8 *) &copy, sizeof(copy), 0));
+}
+
+static size_t align(size_t n)
+{
+	return (n + SECTION_ALIGN - 1) / SECTION_ALIGN * SECTION_ALIGN;
+}
+
+/* Returns -1 if the file can't be written */
+int write_state_file(const char *path)
+{
+	struct file_header *h;
+	struct file_section *table;
+	struct state s = { STATE_SAVE, NULL, 0 };
+	size_t i, len = align(sizeof(*h) + N_SECTIONS * sizeof(*table));
+	u8 *buf;
+	FILE *fp;
+	int ret = 0;
+
+	for (i = 0; i < N_SECTIONS; i++)
+		len += align(section_size(&sections[i]));
+	buf = calloc(1, len);
+	if (!buf)
+		return -1;
+
+	h = (struct file_header *) buf;
+	table = (struct file_section *) (h + 1);
+	memcpy(h->magic, FILE_MAGIC, sizeof(h->magic));
+	h->version = FILE_VERSION;
+	h->sections = N_SECTIONS;
+	h->rom = rom_hash();
+
+	len = align(sizeof(*h) + N_SECTIONS * sizeof(*table));
+	for (i = 0; i < N_SECTIONS; i++) {
+		s.buf = buf + len;
+		s.pos = 0;
+		sections[i].state(&s);
+		table[i].id = sections[i].id;
+		table[i].offset = len;
+		table[i].size = s.pos;
+		table[i].hash = hash64(s.buf, s.pos, 0);
+		len += align(s.pos);
+	}
+	h->checksum = header_checksum(h, table);
+
+	fp = fopen(path, "wb");
+	if (!fp) {
+		free(buf);
+		return -1;
+	}
+	if (fwrite(buf, 1, len, fp) != len)
+		ret = -1;
+	if (fclose(fp) != 0)
+		ret = -1;
+	free(buf);
+	return ret;
+}
+
+static int check_state_file(struct state_file *f)
+{
+	const struct file_header *h = f->map;
+	const struct file_section *table = (const void *) (h + 1);
+	const struct file_section *t;
+	size_t i, j;
+
+	if (f->len < sizeof(*h) ||
+	    memcmp(h->magic, FILE_MAGIC, sizeof(h->magic)) ||
+	    h->version != FILE_VERSION || h->rom != rom_hash() ||
+	    h->sections > (f->len - sizeof(*h)) / sizeof(*table) ||
+	    h->checksum != header_checksum(h, table))
+		return -1;
+
+	for (i = 0; i < N_SECTIONS; i++) {
+		for (j = 0, t = NULL; j < h->sections && !t; j++)
+			if (table[j].id == sections[i].id)
+				t = &table[j];
+		if (!t || t->size != section_size(&sections[i]) ||
+		    t->offset > f->len || t->size > f->len - t->offset)
+			return -1;
+
+		f->data[i] = (const u8 *) f->map + t->offset;
+		if (hash64(f->data[i], t->size, 0) != t->hash)
+			return -1;
+	}
+	return 0;
+}
+
+/*
+ * Map a state file and check that it is complete and belongs to the
+ * loaded ROM. Returns NULL if it can't be used.
+ */
+struct state_file *open_state_file(const char *path)
+{
+	struct state_file *f;
+	struct stat st;
+	int fd;
+
+	f = calloc(1, sizeof(*f));
+	fd = open(path, O_RDONLY);
+	if (!f || fd < 0 || fstat(fd, &st) != 0 || st.st_size == 0) {
+		if (fd >= 0)
+			close(fd);
+		free(f);
+		return NULL;
+	}
+	f->len = st.st_size;
+	f->map = mmap(NULL, f->len, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (f->map == MAP_FAILED) {
+		free(f);
+		return NULL;
+	}
+
+	if (check_state_file(f) != 0) {
+		close_state_file(f);
+		return NULL;
+	}
+	return f;
+}
+
+void load_state_file(const struct state_file *f)
+{
+	struct state s = { STATE_LOAD, NULL, 0 };
+	size_t i;
+
+	for (i = 0; i < N_SECTIONS; i++) {
+		s.buf = (u8 *) f->data[i];
+		s.pos = 0;
+		sections[i].state(&s);
+	}
+	cancel_boot_cache();
+}
+
+void close_state_file(struct state_file *f)
+{
+	munmap(f->map, f->len);
+	free(f);
+}
@@ -0,0 +1,48 @@
+#ifndef STATE_H
+#define STATE_H
+/* Sections of a state file, new ones get new ids */
+enum {
+	SECTION_RAM = 1,
+	SECTION_CPU,
+	SECTION_MEMORY,
+	SECTION_MBC,
+	SECTION_PPU,
+	SECTION_TIMER,
+	SECTION_INTERRUPT,
+	SECTION_SCANLINE
+};
+
+size_t state_size(void);
+
+void save_state(u8 *buf);
+
+void load_state(const u8 *buf);
+
+size_t save_machine(u8 *buf);
+
+struct snapshot;
+
+struct snapshot *take_snapshot(void);
+
+void restore_snapshot(struct snapshot *snap);
+
+size_t snapshot_size(const struct snapshot *snap);
+
+void free_snapshot(struct snapshot *snap);
+
+int set_reset_point(void);
+
+int reset(void);
+
+void bench_reset(void);
+
+struct state_file;
+
+int write_state_file(const char *path);
+
+struct state_file *open_state_file(const char *path);
+
+void load_state_file(const struct state_file *f);
+
+void close_state_file(struct state_file *f);
+#endif
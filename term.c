@@ -0,0 +1,142 @@
+#include <signal.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "gameboy.h"
+
+#include "emu.h"
+#include "term.h"
+#include "video.h"
+
+#define ROWS (HEIGHT / 2)
+
+/*
+ * Terminal display. Every character cell shows two pixels on top of each
+ * other as an upper half block, the upper pixel in the foreground color
+ * and the lower one in the background color. Only cells that changed
+ * since the last frame are written, and the cursor and colors are only
+ * set when they are not already right, so a static screen costs nothing
+ * and a scrolling one a fraction of a full redraw.
+ */
+static const u32 rgb[4] = { 0xCCCCCC, 0xB2B2B2, 0x666666, 0x191919 };
+static const int fg_shade[4] = { 97, 37, 90, 30 };
+
+static int truecolor;
+static u64 interval;
+static u64 next_update;
+static volatile sig_atomic_t interrupted;
+
+/* Upper shade << 2 | lower shade of every cell on the terminal */
+static u8 cells[ROWS][WIDTH];
+static char out[ROWS * WIDTH * 64 + 64];
+static int len;
+
+static void handle_sigint(int sig)
+{
+	(void) sig;
+	interrupted = 1;
+}
+
+static void emit(const char *s)
+{
+	size_t n = strlen(s);
+
+	memcpy(out + len, s, n);
+	len += n;
+}
+
+static void emit_color(int shade, int background)
+{
+	u32 c = rgb[shade];
+
+	if (truecolor)
+		len += sprintf(out + len, "\x1b[%d;2;%u;%u;%um",
+			       background ? 48 : 38, (unsigned) (c >> 16),
+			       (unsigned) ((c >> 8) & 0xFF),
+			       (unsigned) (c & 0xFF));
+	else
+		len += sprintf(out + len, "\x1b[%dm",
+			       fg_shade[shade] + (background ? 10 : 0));
+}
+
+static void flush(void)
+{
+	fwrite(out, 1, len, stdout);
+	fflush(stdout);
+	len = 0;
+}
+
+void init_term(int color, int fps)
+{
+	truecolor = color;
+	interval = 1000000000 / fps;
+	memset(cells, 0xFF, sizeof(cells));
+	signal(SIGINT, handle_sigint);
+	signal(SIGTERM, handle_sigint);
+
+	/* Alternate screen, hidden cursor */
+	emit("\x1b[?1049h\x1b[?25l\x1b[2J");
+	flush();
+}
+
+void close_term(void)
+{
+	emit("\x1b[0m\x1b[?25h\x1b[?1049l");
+	flush();
+}
+
+static void draw_frame(const u8 *frame)
+{
+	static const u8 blank[2 * WIDTH];
+	const u8 *upper, *lower;
+	int row, x, fg = -1, bg = -1, cx = -1, cy = -1;
+	u8 cell;
+
+	for (row = 0; row < ROWS; row++) {
+		upper = frame ? frame + 2 * row * WIDTH : blank;
+		lower = frame ? upper + WIDTH : blank;
+		for (x = 0; x < WIDTH; x++) {
+			cell = (upper[x] << 2) | lower[x];
+			if (cells[row][x] == cell)
+				continue;
+			cells[row][x] = cell;
+
+			if (cy != row || cx != x)
+				len += sprintf(out + len, "\x1b[%d;%dH",
+					       row + 1, x + 1);
+			if (fg != upper[x]) {
+				fg = upper[x];
+				emit_color(fg, 0);
+			}
+			if (bg != lower[x]) {
+				bg = lower[x];
+				emit_color(bg, 1);
+			}
+			/* U+2580 upper half block */
+			emit("\xe2\x96\x80");
+			cx = x + 1;
+			cy = row;
+		}
+	}
+	if (len)
+		flush();
+}
+
+/*
+ * Wait for the next update, at most 'fps' times a second, and draw the
+ * newest frame if there is one. Returns 1 once SIGINT or SIGTERM came in.
+ */
+int term_update(void)
+{
+	const u8 *frame;
+	u64 now = time_ns();
+
+	if (!next_update || now > next_update + interval)
+		next_update = now;
+	next_update += interval;
+	sleep_until(next_update);
+
+	if (take_frame(&frame))
+		draw_frame(frame);
+	return interrupted;
+}
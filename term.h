@@ -0,0 +1,10 @@
+#ifndef TERM_H
+#define TERM_H
+#define TERM_FPS 30
+
+void init_term(int truecolor, int fps);
+
+void close_term(void);
+
+int term_update(void);
+#endif
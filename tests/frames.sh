@@ -0,0 +1,53 @@
+#!/bin/sh
+# Run every entry of a golden frame manifest headless and in parallel.
+# A mismatching entry leaves the frame it got as a PGM image in $OUT.
+#
+# usage: frames.sh <manifest> [<tmpgb>]
+
+if [ "$1" = "--one" ]; then
+	rom=$2
+	frames=$3
+	expected=$4
+	name=$(basename "$rom" | sed 's/\.[^.]*$//')-$frames
+
+	if [ ! -f "$rom" ]; then
+		echo "skip $rom: missing"
+		exit 0
+	fi
+	if ! got=$("$TMPGB" -n "$frames" --dump "$OUT/$name.pgm" "$rom"); then
+		echo "FAIL $rom $frames: tmpgb failed"
+		exit 1
+	fi
+	if [ "$got" != "$expected" ]; then
+		echo "FAIL $rom $frames: expected $expected, got $got, see $OUT/$name.pgm"
+		exit 1
+	fi
+	rm -f "$OUT/$name.pgm"
+	echo "ok   $rom $frames"
+	exit 0
+fi
+
+manifest=${1:?usage: frames.sh <manifest> [<tmpgb>]}
+TMPGB=${2:-./tmpgb}
+OUT=${OUT:-tests/out}
+JOBS=${JOBS:-$(getconf _NPROCESSORS_ONLN 2>/dev/null || echo 2)}
+export TMPGB OUT
+
+entries=$(grep -v -e '^[[:space:]]*#' -e '^[[:space:]]*$' "$manifest")
+runnable=0
+for rom in $(echo "$entries" | awk '{ print $1 }'); do
+	[ -f "$rom" ] && runnable=$((runnable + 1))
+done
+if [ $runnable -eq 0 ]; then
+	echo "no frame test ran, $manifest has no entry with its ROM present"
+	exit 1
+fi
+
+mkdir -p "$OUT"
+echo "$entries" | xargs -n 3 -P "$JOBS" "$0" --one
+status=$?
+
+if [ $status -ne 0 ]; then
+	echo "frame test failures, see above"
+	exit 1
+fi
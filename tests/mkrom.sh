@@ -0,0 +1,43 @@
+#!/bin/sh
+# Write a 32 KB test ROM for the frame tests. It fills tile 1 with a
+# pattern and the background map with tiles 0 and 1 in turn, then scrolls
+# the background one pixel to the left every frame.
+#
+# usage: mkrom.sh <file>
+
+out=${1:?usage: mkrom.sh <file>}
+
+# Write the bytes given in hex after the offset $1 there
+put() {
+	at=$1
+	shift
+	bytes=
+	for h in $(echo "$*" | tr -d ' ' | sed 's/../& /g'); do
+		bytes="$bytes$(printf '\\%03o' $((0x$h)))"
+	done
+	printf "$bytes" | dd of="$out" bs=1 seek=$((at)) conv=notrunc 2>/dev/null
+}
+
+dd if=/dev/zero of="$out" bs=1024 count=32 2>/dev/null || exit 1
+
+# Header: nop; jp $0150, the logo, the title and the header checksum
+put 0x100 00c35001
+put 0x104 ceed6666cc0d000b03730083000c000d0008111f8889000e
+put 0x11c dccc6ee6ddddd999bbbb67636e0eecccdddc999fbbb9333e
+put 0x134 54455354524f4d
+put 0x14d b9
+
+#        ld hl, $8010; ld b, 16
+put 0x150 211080 0610
+# tile:  ld a, l; ld (hl+), a; dec b; jr nz, tile
+put 0x155 7d 22 05 20fb
+#        ld hl, $9800; ld bc, $0400
+put 0x15a 210098 010004
+# map:   ld a, l; and 1; ld (hl+), a; dec bc; ld a, b; or c; jr nz, map
+put 0x160 7d e601 22 0b 78 b1 20f7
+# frame: ldh a, (LY); cp 144; jr nz, frame
+put 0x169 f044 fe90 20fa
+#        ldh a, (SCX); inc a; ldh (SCX), a
+put 0x16f f043 3c e043
+# wait:  ldh a, (LY); cp 144; jr z, wait; jr frame
+put 0x174 f044 fe90 28fa 18ed
@@ -50,3 +50,10 @@ void update_timer(void)
 		tima_count -= cpu_clock;
 	}
 }
+
+void timer_state(struct state *s)
+{
+	STATE(s, cpu_clock);
+	STATE(s, tima_count);
+	STATE(s, div_count);
+}
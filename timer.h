@@ -1,4 +1,5 @@
 #ifndef TIMER_H
 #define TIMER_H
 void update_timer(void);
+void timer_state(struct state *s);
 #endif
@@ -1,24 +1,103 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <errno.h>
+#include <limits.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/wait.h>
+#include <unistd.h>
 
 #include "gameboy.h"
 
+#include "boot.h"
+#include "compose.h"
 #include "cpu.h"
 #include "debug.h"
 #include "display.h"
+#include "emu.h"
 #include "error.h"
+#include "hash.h"
 #include "memory.h"
+#include "movie.h"
+#include "pace.h"
+#include "record.h"
+#include "rewind.h"
+#include "runahead.h"
+#include "scale.h"
+#include "state.h"
+#include "term.h"
 #include "timer.h"
+#include "video.h"
+#include "worker.h"
 
 #define READ_SIZE 0x4000
 #define BROM_SIZE 256
 
 static char *bootrom;
+static int boot_cache = 1;
+static int turbo;
+static int render_thread;
+static int scale = 1;
+static int filter = FILTER_NONE;
+static int aspect;
+static int bench;
+static const char *record;
+static int record_every = 1;
+static long rewind_kb;
+static int rewind_every = REWIND_EVERY;
+static int ahead;
+
+/* State files to start from and to write on exit */
+static const char *load_path;
+static const char *save_path;
+
+/* Input movies */
+static const char *movie;
+static int movie_hashes;
+static const char *play;
+static int verify;
+static int jobs;
+
+/* Fork server jobs press buttons after a number of frames */
+#define MAX_INPUTS 1024
+
+static int server;
+static struct job_input {
+	long frame;
+	u8 buttons;
+} job[MAX_INPUTS];
+static int job_inputs;
+
+/* Draw to the terminal instead of a window */
+enum {
+	TERM_NONE,
+	TERM_SHADE,
+	TERM_COLOR
+};
+static int terminal = TERM_NONE;
+
+/* Headless runs for regression tests */
+static long headless_frames;
+static int print_hashes;
+static const char *dump;
 
 static void usage(void)
 {
-	usagef("tmpgb [-b <boot-rom>] [-d] <rom>");
+	usagef("tmpgb [-a] [-b <boot-rom>] [-d] [-f <n|auto>] "
+	       "[-F <none|scale2x|smooth>] [-o <n>] [-p <scanline|fifo>] [-r] "
+	       "[-s <speed>] [-t <color|shade>] [-v] [-z <scale>]\n"
+	       "             [--record <file>] [--record-every <n>] "
+	       "[--rewind <kb>] [--rewind-every <n>]\n"
+	       "             [--run-ahead <n>] [--movie <file> [--movie-hashes]] "
+	       "[--play <file>]\n"
+	       "             [--load-state <file>] [--save-state <file>] "
+	       "[--turbo-boot] [--no-boot-cache] <rom>\n"
+	       "       tmpgb -n <frames> [--hashes] [--dump <file>] <rom>\n"
+	       "       tmpgb --verify [-j <n>] <rom> <movie>...\n"
+	       "       tmpgb --fork-server [-b <boot-rom>] [--load-state <file>] "
+	       "<rom>\n"
+	       "       tmpgb -B [<rom>]");
 }
 
 static void load_bootrom(const char *bootrom)
@@ -68,34 +147,342 @@ static void load_rom(const char *rom)
 	fclose(fp);
 }
 
-static void run(void)
+/* One instruction, called in a loop on the emulation thread */
+static void step(void)
 {
-	int quit = 0;
+	boot_step();
+	movie_step();
+	if (debug_enabled()) {
+		debug();
+	} else {
+		update_timer();
+		update_screen();
+		pace(cpu_cycle() - old_cpu_cycle());
+		fetch_opcode();
+	}
+}
+
+/* Press the buttons of the job inputs due after 'frame' frames */
+static int press_job_inputs(int next, long frame)
+{
+	while (next < job_inputs && job[next].frame <= frame)
+		set_buttons(job[next++].buttons);
+	return next;
+}
+
+/*
+ * Emulate 'headless_frames' frames on this thread as fast as possible and
+ * print the hash of the last one. While the LCD is off a blank frame is
+ * counted every FRAME_CYCLES cycles.
+ */
+static void run_headless(void)
+{
+	static const u8 blank[WIDTH * HEIGHT];
+	const u8 *frame = blank;
+	long n = 0;
+	int ret, off = 0, next;
+
+	next = press_job_inputs(0, 0);
+	while (n < headless_frames) {
+		boot_step();
+		movie_step();
+		update_timer();
+		ret = draw();
+		if (ret == LCD_OFF) {
+			off += cpu_cycle() - old_cpu_cycle();
+		} else if (ret & LCD_VBLANK) {
+			rewind_frame();
+			movie_frame();
+			frame = run_ahead_enabled() ? run_ahead() : get_frame();
+		}
+		fetch_opcode();
+
+		if (ret == LCD_OFF) {
+			if (off < FRAME_CYCLES)
+				continue;
+			off -= FRAME_CYCLES;
+			frame = blank;
+		} else if (!(ret & LCD_VBLANK)) {
+			continue;
+		}
+
+		n++;
+		next = press_job_inputs(next, n);
+		if (print_hashes)
+			printf("%ld %016llx\n", n,
+			       (unsigned long long) hash_frame(frame));
+	}
+
+	/* A fork server job that fails prints nothing but the failure */
+	if (dump && dump_frame(dump, frame) != 0)
+		die_errno("could not write %s", dump);
+	if (!print_hashes)
+		printf("%016llx\n", (unsigned long long) hash_frame(frame));
+}
 
+static void init(void)
+{
 	if (init_memory() != 0)
 		die("invalid rom");
 
 	init_cpu();
+	init_compose();
+
+	/*
+	 * Start past the boot ROM if it ran for this cartridge before. Runs
+	 * that print hashes always boot, so they don't depend on the cache.
+	 */
+	if (bootrom && boot_cache && !headless_frames && !verify && !server &&
+	    !load_boot_cache()) {
+		if (turbo)
+			turbo_boot();
+		else
+			wait_for_boot();
+	}
+}
+
+/* Runs in a process of its own, returns its exit status */
+static int verify_movie(const char *path)
+{
+	long frame;
 
-	if (init_sdl() != 0)
+	if (load_movie(path) != 0) {
+		printf("%s: could not load\n", path);
+		return 2;
+	}
+	frame = replay_movie();
+	if (frame >= 0) {
+		printf("%s: desync at frame %ld\n", path, frame);
+		return 1;
+	}
+	printf("%s: ok\n", path);
+	return 0;
+}
+
+/*
+ * Replay every movie to its end and check the state hashes it holds. The
+ * machine lives in globals, so each movie gets a process of its own, at
+ * most 'jobs' at a time. Returns the number of movies that failed.
+ */
+static int verify_movies(char **movies, int n)
+{
+	int i, running = 0, failed = 0, status;
+	pid_t pid;
+
+	fflush(stdout);
+	for (i = 0; i < n || running; ) {
+		if (i < n && running < jobs) {
+			pid = fork();
+			if (pid < 0)
+				die_errno("could not fork");
+			if (pid == 0)
+				exit(verify_movie(movies[i]));
+			running++;
+			i++;
+			continue;
+		}
+		if (wait(&status) < 0)
+			die_errno("could not wait");
+		running--;
+		if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+			failed++;
+	}
+
+	printf("%d of %d movies failed\n", failed, n);
+	return failed;
+}
+
+/*
+ * A job is a line of the number of frames to run followed by inputs as
+ * <frame>:<buttons>, the buttons in hex as in enum button, pressed after
+ * that many frames and in order.
+ */
+static int parse_job(char *line)
+{
+	char *p = line, *end;
+	long frame, buttons;
+
+	headless_frames = strtol(p, &end, 10);
+	if (end == p || headless_frames < 1)
+		return -1;
+
+	for (job_inputs = 0; ; job_inputs++) {
+		p = end;
+		while (*p == ' ' || *p == '\t')
+			p++;
+		if (*p == '\n' || *p == '\0')
+			return 0;
+		frame = strtol(p, &end, 10);
+		if (end == p || *end != ':' || job_inputs == MAX_INPUTS ||
+		    frame < 0 || (job_inputs && frame < job[job_inputs - 1].frame))
+			return -1;
+		p = end + 1;
+		buttons = strtol(p, &end, 16);
+		if (end == p || buttons < 0 || buttons > 0xFF)
+			return -1;
+		job[job_inputs].frame = frame;
+		job[job_inputs].buttons = buttons;
+	}
+}
+
+/*
+ * Fork server. Every line on stdin is a job that runs headless in a copy
+ * on write child of the machine set up once, so a job costs a fork()
+ * instead of loading and booting the ROM. Each job prints what -n would,
+ * "error" if the line is not a job, "crash <signal>" if the child died or
+ * "exit <status>" if it failed.
+ */
+static void serve(void)
+{
+	char line[16384];
+	int status;
+	pid_t pid;
+
+	while (fgets(line, sizeof(line), stdin)) {
+		if (parse_job(line) != 0) {
+			printf("error\n");
+			fflush(stdout);
+			continue;
+		}
+
+		pid = fork();
+		if (pid < 0)
+			die_errno("could not fork");
+		if (pid == 0) {
+			run_headless();
+			fflush(stdout);
+			_exit(0);
+		}
+		if (waitpid(pid, &status, 0) < 0)
+			die_errno("could not wait");
+		if (WIFSIGNALED(status))
+			printf("crash %d\n", WTERMSIG(status));
+		else if (WEXITSTATUS(status) != 0)
+			printf("exit %d\n", WEXITSTATUS(status));
+		fflush(stdout);
+	}
+}
+
+static void load_state_path(const char *path)
+{
+	struct state_file *f = open_state_file(path);
+
+	if (!f)
+		die("%s is not a state of this ROM", path);
+	load_state_file(f);
+	close_state_file(f);
+}
+
+static void save_state_path(const char *path)
+{
+	if (write_state_file(path) != 0)
+		die_errno("could not write %s", path);
+}
+
+static void run(void)
+{
+	int quit = 0;
+
+	init();
+	/* Jobs start after the boot, which the cache is kept out of */
+	if (server)
+		run_boot();
+	if (load_path)
+		load_state_path(load_path);
+
+	if (rewind_kb && (movie || play))
+		die("--rewind can't be used with movies");
+	if (play && load_movie(play) != 0)
+		die("could not play %s", play);
+	if (movie && start_movie(movie, movie_hashes) != 0)
+		die_errno("could not record to %s", movie);
+
+	if (rewind_kb && init_rewind(rewind_kb * 1024, rewind_every) != 0)
+		die("could not allocate the rewind buffer");
+	if (ahead && init_run_ahead(ahead) != 0)
+		die("could not allocate the run-ahead state");
+
+	if (server) {
+		serve();
+		return;
+	}
+
+	if (headless_frames) {
+		run_headless();
+		if (save_path)
+			save_state_path(save_path);
+		stop_movie();
+		close_rewind();
+		close_run_ahead();
+		return;
+	}
+
+	if (terminal)
+		init_term(terminal == TERM_COLOR, TERM_FPS);
+	else if (init_sdl() != 0)
 		die("Failed to create window");
 	setup_debug();
 
+	/* Every run-ahead restore would have to restart the render thread */
+	if (render_thread && !ahead && !strcmp(ppu_name(), "scanline"))
+		start_render_thread();
+
+	if (record && start_recording(record, record_every) != 0)
+		die_errno("could not record to %s", record);
+
+	start_emulation(step);
 	while (!quit) {
-		quit = handle_event();
-		if (debug_enabled()) {
-			debug();
+		if (terminal) {
+			quit = term_update();
 		} else {
-			update_timer();
-			update_screen();
-			fetch_opcode();
+			quit = handle_event();
+			present_screen();
 		}
 	}
+
+	stop_emulation();
+	stop_render_thread();
+	stop_recording();
+	if (save_path)
+		save_state_path(save_path);
+	stop_movie();
+	close_rewind();
+	close_run_ahead();
+
+	if (terminal)
+		close_term();
+	else
+		close_sdl();
+}
+
+/* Parse a whole decimal number from min to max, returns -1 otherwise */
+static int parse_long(const char *s, long min, long max, long *v)
+{
+	char *end;
+
+	errno = 0;
+	*v = strtol(s, &end, 10);
+	if (end == s || *end || errno || *v < min || *v > max)
+		return -1;
+	return 0;
+}
+
+static int parse_int(const char *s, int min, int max, int *v)
+{
+	long n;
+
+	if (parse_long(s, min, max, &n) != 0)
+		return -1;
+	*v = n;
+	return 0;
 }
 
 static int handle_options(int *argc, char ***argv)
 {
 	int ret = 0;
+	double speed;
+	char *end;
+	int n;
 
 	while (*argc > 0) {
 		const char *cmd = (*argv)[0];
@@ -105,6 +492,154 @@ static int handle_options(int *argc, char ***argv)
 
 		if (!strcmp(cmd, "-d"))
 			enable_debug();
+		if (!strcmp(cmd, "-r"))
+			render_thread = 1;
+		if (!strcmp(cmd, "-v"))
+			enable_vsync();
+		if (!strcmp(cmd, "-a"))
+			aspect = 1;
+		if (!strcmp(cmd, "-B"))
+			bench = 1;
+		if (!strcmp(cmd, "-z")) {
+			(*argv)++;
+			(*argc)--;
+			if (*argc < 2 ||
+			    parse_int((*argv)[0], 1, MAX_SCALE, &scale) != 0)
+				return -1;
+		}
+		if (!strcmp(cmd, "-n")) {
+			(*argv)++;
+			(*argc)--;
+			if (*argc < 2 || parse_long((*argv)[0], 1, LONG_MAX,
+						    &headless_frames) != 0)
+				return -1;
+		}
+		if (!strcmp(cmd, "--hashes"))
+			print_hashes = 1;
+		if (!strcmp(cmd, "--dump")) {
+			(*argv)++;
+			(*argc)--;
+			if (*argc < 2)
+				return -1;
+			dump = (*argv)[0];
+		}
+		if (!strcmp(cmd, "--record")) {
+			(*argv)++;
+			(*argc)--;
+			if (*argc < 2)
+				return -1;
+			record = (*argv)[0];
+		}
+		if (!strcmp(cmd, "--record-every")) {
+			(*argv)++;
+			(*argc)--;
+			if (*argc < 2 ||
+			    parse_int((*argv)[0], 1, INT_MAX, &record_every) != 0)
+				return -1;
+		}
+		if (!strcmp(cmd, "--rewind")) {
+			(*argv)++;
+			(*argc)--;
+			if (*argc < 2 || parse_long((*argv)[0], 1, LONG_MAX / 1024,
+						    &rewind_kb) != 0)
+				return -1;
+		}
+		if (!strcmp(cmd, "--rewind-every")) {
+			(*argv)++;
+			(*argc)--;
+			if (*argc < 2 ||
+			    parse_int((*argv)[0], 1, INT_MAX, &rewind_every) != 0)
+				return -1;
+		}
+		if (!strcmp(cmd, "--run-ahead")) {
+			(*argv)++;
+			(*argc)--;
+			if (*argc < 2 ||
+			    parse_int((*argv)[0], 1, MAX_RUN_AHEAD, &ahead) != 0)
+				return -1;
+		}
+		if (!strcmp(cmd, "--movie")) {
+			(*argv)++;
+			(*argc)--;
+			if (*argc < 2)
+				return -1;
+			movie = (*argv)[0];
+		}
+		if (!strcmp(cmd, "--movie-hashes"))
+			movie_hashes = 1;
+		if (!strcmp(cmd, "--play")) {
+			(*argv)++;
+			(*argc)--;
+			if (*argc < 2)
+				return -1;
+			play = (*argv)[0];
+		}
+		if (!strcmp(cmd, "--load-state")) {
+			(*argv)++;
+			(*argc)--;
+			if (*argc < 2)
+				return -1;
+			load_path = (*argv)[0];
+		}
+		if (!strcmp(cmd, "--save-state")) {
+			(*argv)++;
+			(*argc)--;
+			if (*argc < 2)
+				return -1;
+			save_path = (*argv)[0];
+		}
+		if (!strcmp(cmd, "--fork-server"))
+			server = 1;
+		if (!strcmp(cmd, "--turbo-boot"))
+			turbo = 1;
+		if (!strcmp(cmd, "--no-boot-cache"))
+			boot_cache = 0;
+		if (!strcmp(cmd, "--verify"))
+			verify = 1;
+		if (!strcmp(cmd, "-j")) {
+			(*argv)++;
+			(*argc)--;
+			if (*argc < 2 ||
+			    parse_int((*argv)[0], 1, INT_MAX, &jobs) != 0)
+				return -1;
+		}
+		if (!strcmp(cmd, "-t")) {
+			(*argv)++;
+			(*argc)--;
+			if (*argc < 2)
+				return -1;
+			if (!strcmp((*argv)[0], "color"))
+				terminal = TERM_COLOR;
+			else if (!strcmp((*argv)[0], "shade"))
+				terminal = TERM_SHADE;
+			else
+				return -1;
+		}
+		if (!strcmp(cmd, "-F")) {
+			(*argv)++;
+			(*argc)--;
+			if (*argc < 2)
+				return -1;
+			if (!strcmp((*argv)[0], "none"))
+				filter = FILTER_NONE;
+			else if (!strcmp((*argv)[0], "scale2x"))
+				filter = FILTER_SCALE2X;
+			else if (!strcmp((*argv)[0], "smooth"))
+				filter = FILTER_SMOOTH;
+			else
+				return -1;
+		}
+		if (!strcmp(cmd, "-s")) {
+			(*argv)++;
+			(*argc)--;
+			if (*argc < 2)
+				return -1;
+			errno = 0;
+			speed = strtod((*argv)[0], &end);
+			if (end == (*argv)[0] || *end || errno || !(speed >= 0))
+				return -1;
+			set_speed(speed);
+		}
 		if (!strcmp(cmd, "-b")) {
 			(*argv)++;
 			(*argc)--;
@@ -112,6 +647,33 @@ static int handle_options(int *argc, char ***argv)
 				return -1;
 			bootrom = (*argv)[0];
 		}
+		if (!strcmp(cmd, "-o")) {
+			(*argv)++;
+			(*argc)--;
+			if (*argc < 2 || parse_int((*argv)[0], 1, INT_MAX, &n) != 0)
+				return -1;
+			set_frame_requests(n);
+		}
+		if (!strcmp(cmd, "-p")) {
+			(*argv)++;
+			(*argc)--;
+			if (*argc < 2)
+				return -1;
+			if (set_ppu((*argv)[0]) != 0)
+				return -1;
+		}
+		if (!strcmp(cmd, "-f")) {
+			(*argv)++;
+			(*argc)--;
+			if (*argc < 2)
+				return -1;
+			if (!strcmp((*argv)[0], "auto"))
+				set_frameskip(FRAMESKIP_AUTO);
+			else if (parse_int((*argv)[0], 0, INT_MAX, &n) == 0)
+				set_frameskip(n);
+			else
+				return -1;
+		}
 		(*argv)++;
 		(*argc)--;
 	}
@@ -131,15 +693,43 @@ int main(int argc, char **argv)
 	argv++;
 	res = handle_options(&argc, &argv);
 
+	if (bench) {
+		bench_scale();
+		if (argc > 0) {
+			if (bootrom)
+				load_bootrom(bootrom);
+			load_rom(argv[0]);
+			init();
+			/* Reset to after the boot, not to power on */
+			run_boot();
+			bench_reset();
+		}
+		return 0;
+	}
+
 	if (res != 0)
 		usage();
 
+	if (filter != FILTER_NONE && scale % 2)
+		die("filters need an even scale");
+	set_display_scale(scale, filter, aspect);
+
 	rom = argv[0];
 	if (bootrom)
 		load_bootrom(bootrom);
 	load_rom(rom);
+
+	if (verify) {
+		if (argc < 2)
+			usage();
+		if (!jobs)
+			jobs = sysconf(_SC_NPROCESSORS_ONLN);
+		if (jobs < 1)
+			jobs = 1;
+		init();
+		return verify_movies(argv + 1, argc - 1) ? 1 : 0;
+	}
 	run();
-	close_sdl();
 
 	return 0;
 }
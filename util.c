@@ -1,3 +1,8 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <errno.h>
+#include <time.h>
+
 #include "gameboy.h"
 
 u8 set_bit(u8 val, int bit)
@@ -14,3 +19,22 @@ int get_bit(u8 val, int bit)
 {
 	return (val >> bit) & 1;
 }
+
+u64 time_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (u64) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* Sleep until time_ns() reaches 'ns' */
+void sleep_until(u64 ns)
+{
+	struct timespec ts;
+
+	ts.tv_sec = ns / 1000000000;
+	ts.tv_nsec = ns % 1000000000;
+	while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR)
+		;
+}
@@ -1,186 +1,119 @@
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
 
 #include "gameboy.h"
 
 #include "cpu.h"
+#include "fifo.h"
 #include "interrupt.h"
 #include "memory.h"
+#include "render.h"
 #include "video.h"
-
-#define OBJ_BG_PRIORITY (1<<7)
-#define YFLIP (1<<6)
-#define XFLIP (1<<5)
-#define PALETTENR (1<<4)
-
-struct sprite {
-	u8 y;
-	u8 x;
-	u8 tilenr;
-	u8 flags;
-	int addr;
-};
-
-enum px_type {
-	BG,
-	SPRITE,
-	WINDOW
-};
-
-struct pixel {
-	int color;
-	enum px_type type;
-};
+#include "worker.h"
 
 static int clock;
+static int hblank = 204;
 static u8 lcdc;
 static u8 ly;
-static int bg_map;
-static u8 *screen;
-static int bg_palette[4] = { 0, 1, 2, 3 };
-static int obj_palette_0[4] = { 0, 1, 2, 3 };
-static int obj_palette_1[4] = { 0, 1, 2, 3 };
+static int window_line;
 
-static struct sprite spr[40];
+/* The line being drawn: OAM search fills in the sprites, mode 3 the rest */
+static struct scanline line;
 static int spr_height;
 
-static int cmp_sprites(const void *p1, const void *p2)
-{
-	struct sprite *s1 = (struct sprite *) p1;
-	struct sprite *s2 = (struct sprite *) p2;
-
-	if (s1->x < s2->x)
-		return -1;
-	else if (s1->x > s2->x)
-		return 1;
-	else if (s1->addr < s2->addr)
-		return -1;
-	else if (s1->addr > s2->addr)
-		return 1;
-	else
-		return 0;
-}
-
+/*
+ * Frame skipping. Skipped frames keep the full mode/LY/interrupt timing
+ * but do no OAM search, line rendering or palette work. In auto mode
+ * the skip count follows the measured emulation speed.
+ */
+static int frameskip;
+static int frameskip_auto;
+static int skip_count;
+static int skipping;
+static double target_speed = 1.0;
+static u64 speed_last;
+static int speed_frames;
+
+/*
+ * On demand rendering. When enabled, a frame is drawn only if it was
+ * asked for with request_frame() or is one of every 'frame_every'th
+ * frames, all other frames are skipped as above. This overrides the
+ * frame skip setting.
+ */
+static int on_demand;
+static int frame_every;
+static int frame_requests;
+static u64 frame_nr;
+
+/* Set while the window is not visible, every frame is skipped */
+static int render_paused;
+
+/* The screen was blanked, the next frame must not count as unchanged */
+static int lcd_was_off;
+
+/*
+ * Select the first 10 sprites in OAM that cover the current line and
+ * order them by X position, lower OAM index first on ties.
+ */
 static void oam_search(void)
 {
-	int i;
+	const u8 *oam = get_oam();
+	struct sprite *spr = line.spr;
 	struct sprite sp;
-	int spr_size = 0;
-
-	for (i = 0xFE00; i < 0xFEA0; i += 4) {
-		u8 y = read_memory(i);
-		if (ly <= y && ly > (y - spr_height)) {
-			sp.y = read_memory(i);
-			sp.x = read_memory(i + 1);
-			sp.tilenr = read_memory(i + 2);
-			sp.flags = read_memory(i + 3);
-			sp.addr = i;
-
-			spr[spr_size] = sp;
-			spr_size++;
-		}
-	}
-	qsort(spr, spr_size, sizeof(struct sprite), cmp_sprites);
-}
-
-static u8 extract_color(u8 lsb, u8 msb, int px)
-{
-	px = 7 - px;
-	return ((lsb >> px) & 0x1) + (((msb >> px) & 0x1) << 1);
-}
-
-static u8 tiledata(u8 tilenr, u8 xoff, u8 yoff, enum px_type type)
-{
-	int offset = (tilenr * 16) + (2 * yoff);
-	int lsb, msb;
-	u16 addr = 0x8000 + offset;
-
-	if (type != SPRITE) {
-		if (!get_bit(lcdc, 4)) {
-			if (tilenr < 128)
-				addr = 0x9000 + offset;
-			else
-				addr = 0x8800 + ((tilenr - 128) * 16) + (2 * yoff);
-		}
+	int i, j;
+
+	line.ly = ly;
+	line.spr_count = 0;
+	for (i = 0; i < 40 && line.spr_count < MAX_SPRITES; i++) {
+		int row = ly + 16 - oam[4 * i];
+
+		if (row < 0 || row >= spr_height)
+			continue;
+
+		sp.y = oam[4 * i];
+		sp.x = oam[4 * i + 1];
+		sp.tilenr = oam[4 * i + 2];
+		sp.flags = oam[4 * i + 3];
+		sp.addr = i;
+
+		for (j = line.spr_count; j > 0 && spr[j - 1].x > sp.x; j--)
+			spr[j] = spr[j - 1];
+		spr[j] = sp;
+		line.spr_count++;
 	}
-	lsb = read_memory(addr);
-	msb = read_memory(addr + 1);
-	return extract_color(lsb, msb, xoff);
 }
 
-static int spritedata(int x)
+void vram_written(u16 offset, u8 value)
 {
-	int i, color;
-	u8 xoff, yoff;
-	const int MAX_SPRITES = 10;
-
-	for (i = 0; i < MAX_SPRITES; i++) {
-		if (spr[i].x - 8 <= x && spr[i].x >= (x+1)) {
-			xoff = 8 - (spr[i].x - x);
-			yoff = (spr_height) - (spr[i].y - ly);
-			color = tiledata(spr[i].tilenr, xoff, yoff, SPRITE);
-			if (color == 0)
-				break;
-			if (spr[i].flags & PALETTENR)
-				return obj_palette_1[color];
-			else
-				return obj_palette_0[color];
-		}
-	}
-	return -1;
+	if (render_thread_running())
+		worker_vram_write(offset, value);
+	else
+		render_vram_write(offset);
 }
 
 static void pixel_transfer(void)
 {
-	u8 scy = read_memory(0xFF42);
-	u8 scx = read_memory(0xFF43);
-	u8 line_offset = ly + scy;
-	int offset = bg_map + (scx / 8) + (32 * (line_offset / 8));
-	int i;
-	int tilenr = read_memory(offset);
-	struct pixel px;
-	int color;
-	u8 yoff = (scy + ly) % 8;
-
-	for (i = 0; i < WIDTH; i++) {
-		u8 xoff = (i + scx) % 8;
-		if (xoff == 0)
-			tilenr = read_memory(offset + (i / 8));
-
-		px.color = tiledata(tilenr, xoff, yoff, BG);
-		px.color = bg_palette[px.color];
-		px.type = BG;
-		if (get_bit(lcdc, 1)) {
-			color = spritedata(i);
-			if (color >= 0) {
-				px.color = color;
-				px.type = SPRITE;
-			}
-		}
-		screen[i] = px.color;
-	}
-}
+	if (ly == 0)
+		window_line = 0;
+
+	line.regs[LINE_LCDC] = lcdc;
+	line.regs[LINE_SCY] = read_memory(0xFF42);
+	line.regs[LINE_SCX] = read_memory(0xFF43);
+	line.regs[LINE_WY] = read_memory(0xFF4A);
+	line.regs[LINE_WX] = read_memory(0xFF4B);
+	line.regs[LINE_BGP] = read_memory(0xFF47);
+	line.regs[LINE_OBP0] = read_memory(0xFF48);
+	line.regs[LINE_OBP1] = read_memory(0xFF49);
+	line.regs[LINE_WINDOW] = window_line;
+
+	if (render_thread_running())
+		worker_line(&line);
+	else
+		render_line(&line);
 
-static void update_palette(void)
-{
-	u8 bgp_data = read_memory(0xFF47);
-	u8 obj_data_0 = read_memory(0xFF48);
-	u8 obj_data_1 = read_memory(0xFF49);
-
-	bg_palette[0] = bgp_data & 0x3;
-	bg_palette[1] = (bgp_data >> 2) & 0x3;
-	bg_palette[2] = (bgp_data >> 4) & 0x3;
-	bg_palette[3] = (bgp_data >> 6) & 0x3;
-
-	obj_palette_0[0] = obj_data_0 & 0x3;
-	obj_palette_0[1] = (obj_data_0 >> 2) & 0x3;
-	obj_palette_0[2] = (obj_data_0 >> 4) & 0x3;
-	obj_palette_0[3] = (obj_data_0 >> 6) & 0x3;
-
-	obj_palette_1[0] = obj_data_1 & 0x3;
-	obj_palette_1[1] = (obj_data_1 >> 2) & 0x3;
-	obj_palette_1[2] = (obj_data_1 >> 4) & 0x3;
-	obj_palette_1[3] = (obj_data_1 >> 6) & 0x3;
+	if (window_x(&line) < WIDTH)
+		window_line++;
 }
 
 static void update_registers(void)
@@ -189,12 +122,6 @@ static void update_registers(void)
 	ly = read_memory(0xFF44);
 	spr_height = (get_bit(lcdc, 2)) ? 16 : 8;
 	clock += (cpu_cycle() - old_cpu_cycle());
-	update_palette();
-
-	if (get_bit(lcdc, 3))
-		bg_map = 0x9C00;
-	else
-		bg_map = 0x9800;
 }
 
 static u8 set_statmode(u8 stat, u8 statmode)
@@ -218,32 +145,260 @@ static void ly_compare(u8 stat)
 	write_stat(stat);
 }
 
-int draw(u8 *scr)
+void set_frameskip(int n)
+{
+	frameskip_auto = (n == FRAMESKIP_AUTO);
+	frameskip = frameskip_auto ? 0 : n;
+	skip_count = 0;
+	skipping = 0;
+}
+
+void set_target_speed(double speed)
+{
+	target_speed = speed;
+}
+
+static void auto_frameskip(void)
+{
+	u64 now;
+	double speed;
+
+	if (++speed_frames < 16)
+		return;
+
+	now = time_ns();
+	if (speed_last) {
+		speed = (double) speed_frames * FRAME_NS / (now - speed_last);
+		if (speed < target_speed * 0.95 && frameskip < MAX_FRAMESKIP)
+			frameskip++;
+		else if (speed > target_speed * 1.1 && frameskip > 0)
+			frameskip--;
+	}
+	speed_last = now;
+	speed_frames = 0;
+}
+
+static void scanline_begin_line(const struct scanline *sl)
+{
+	(void) sl;
+}
+
+static int scanline_transfer(int *clock)
+{
+	if (*clock < 172)
+		return 0;
+
+	if (!skipping)
+		pixel_transfer();
+	*clock -= 172;
+	return 172;
+}
+
+/* Returns LCD_UNCHANGED if no line of the finished frame was drawn again */
+static int scanline_end_frame(void)
+{
+	if (render_thread_running()) {
+		worker_frame_done(!skipping);
+		return 0;
+	}
+	return render_frame_done() ? 0 : LCD_UNCHANGED;
+}
+
+/*
+ * With a render thread this is the last frame it finished, which may lag
+ * one frame behind the emulation.
+ */
+static const u8 *scanline_frame(void)
+{
+	static u8 frame[HEIGHT * WIDTH];
+
+	if (!render_thread_running())
+		return render_frame();
+
+	worker_frame(frame);
+	return frame;
+}
+
+static const struct ppu_backend scanline_ppu = {
+	"scanline",
+	1,
+	scanline_begin_line,
+	scanline_transfer,
+	scanline_end_frame,
+	scanline_frame
+};
+
+static const struct ppu_backend *backends[] = {
+	&scanline_ppu,
+	&fifo_ppu
+};
+
+static const struct ppu_backend *ppu = &scanline_ppu;
+
+int set_ppu(const char *name)
+{
+	unsigned i;
+
+	for (i = 0; i < sizeof(backends) / sizeof(backends[0]); i++) {
+		if (!strcmp(backends[i]->name, name)) {
+			ppu = backends[i];
+			if (!ppu->frameskip)
+				skipping = 0;
+			return 0;
+		}
+	}
+	return -1;
+}
+
+const char *ppu_name(void)
+{
+	return ppu->name;
+}
+
+const u8 *get_frame(void)
+{
+	return ppu->frame();
+}
+
+static int frame_wanted(void)
+{
+	int want = frame_requests > 0;
+
+	if (frame_requests > 0)
+		frame_requests--;
+	if (frame_every > 0 && frame_nr % frame_every == 0)
+		want = 1;
+	frame_nr++;
+	return want;
+}
+
+/*
+ * Draw every nth frame, or with FRAMES_ON_REQUEST only the frames asked
+ * for with request_frame(). A negative value turns on demand rendering
+ * off again. The first counted frame is the one in progress, so this is
+ * best called before the first frame or at V-Blank.
+ */
+void set_frame_requests(int every)
+{
+	on_demand = (every >= 0);
+	frame_every = every;
+	frame_nr = 0;
+	skip_count = 0;
+	skipping = on_demand && ppu->frameskip && !frame_wanted();
+}
+
+/* Ask for the next frame to be drawn, requests add up */
+void request_frame(void)
+{
+	frame_requests++;
+}
+
+void pause_rendering(int paused)
+{
+	render_paused = paused;
+}
+
+/*
+ * Which frames are drawn. This is up to the host and not part of a state,
+ * but frames emulated only to be thrown away must not move it on.
+ */
+void frame_schedule_state(struct state *s)
+{
+	STATE(s, frameskip);
+	STATE(s, skip_count);
+	STATE(s, skipping);
+	STATE(s, speed_last);
+	STATE(s, speed_frames);
+	STATE(s, frame_nr);
+	STATE(s, frame_requests);
+}
+
+/* Draw the next frame whatever the schedule says */
+void draw_next_frame(void)
+{
+	skipping = 0;
+}
+
+/* Decide at the start of V-Blank whether the next frame is drawn */
+static void next_frame(void)
+{
+	if (render_paused) {
+		skipping = ppu->frameskip;
+		return;
+	}
+
+	if (on_demand) {
+		skipping = ppu->frameskip && !frame_wanted();
+		return;
+	}
+
+	if (frameskip_auto)
+		auto_frameskip();
+
+	if (ppu->frameskip && skip_count < frameskip) {
+		skip_count++;
+		skipping = 1;
+	} else {
+		skip_count = 0;
+		skipping = 0;
+	}
+}
+
+/*
+ * The renderer's caches and, with a render thread, its copy of VRAM only
+ * follow VRAM writes and the lines drawn before, so they have to start
+ * over after a load that changed VRAM or once the LCD is back on.
+ */
+static void reload_render(void)
+{
+	int threaded = render_thread_running();
+
+	if (threaded)
+		stop_render_thread();
+	render_invalidate();
+	if (threaded)
+		start_render_thread();
+}
+
+int draw(void)
 {
 	u8 stat = read_memory(0xFF41);
 	u8 stat_mode = stat & 0x3;
 	int ret = 0;
-	screen = scr;
+	int unchanged;
+	int mode3;
 	update_registers();
 
 	if (!get_bit(lcdc, 7)) {
 		write_ly(0);
+		lcd_was_off = 1;
 		return LCD_OFF;
 	}
+	if (lcd_was_off) {
+		lcd_was_off = 0;
+		reload_render();
+	}
 
 	switch (stat_mode) {
 	/* H-Blank */
 	case 0:
-		if (clock >= 204) {
-			write_ly(ly+1);
+		if (clock >= hblank) {
+			ly++;
+			write_ly(ly);
 			if (ly == 144) {
 				stat = set_statmode(stat, 1);
 				request_interrupt(INT_VBLANK);
+				unchanged = ppu->end_frame();
+				if (skipping)
+					ret = LCD_VBLANK;
+				else
+					ret = LCD_VBLANK | LCD_FRAME | unchanged;
+				next_frame();
 			}
 			else {
 				stat = set_statmode(stat, 2);
 			}
-			clock -= 204;
+			clock -= hblank;
 			ly_compare(stat);
 		}
 		break;
@@ -263,20 +418,49 @@ int draw(u8 *scr)
 	/* OAM Search */
 	case 2:
 		if (clock >= 80) {
-			oam_search();
+			if (!skipping)
+				oam_search();
+			ppu->begin_line(&line);
 			stat = set_statmode(stat, 3);
 			clock -= 80;
 		}
 		break;
 	/* LCD Transfer */
 	case 3:
-		if (clock >= 172) {
-			pixel_transfer();
+		if ((mode3 = ppu->transfer(&clock)) > 0) {
+			if (!skipping)
+				ret = LCD_DRAWN;
 			stat = set_statmode(stat, 0);
-			clock -= 172;
-			ret = LCD_DRAWN;
+			hblank = 376 - mode3;
 		}
 		break;
 	}
 	return ret;
 }
+
+/*
+ * Frame skipping is up to the host, so whether the current frame is drawn
+ * is not part of a state.
+ */
+void video_state(struct state *s)
+{
+	STATE(s, clock);
+	STATE(s, hblank);
+	STATE(s, lcdc);
+	STATE(s, ly);
+	STATE(s, window_line);
+	STATE(s, spr_height);
+	fifo_state(s);
+
+	if (s->mode == STATE_LOAD && take_vram_changed())
+		reload_render();
+}
+
+/*
+ * The line being captured for the renderer. The emulated machine never
+ * reads it back, and it is not filled in for skipped frames.
+ */
+void scanline_state(struct state *s)
+{
+	STATE(s, line);
+}
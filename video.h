@@ -4,10 +4,60 @@
 #define WIDTH 160
 #define HEIGHT 144
 
+/* 70224 cycles at 4.194304 MHz */
+#define FRAME_CYCLES 70224
+#define FRAME_NS 16742706
+#define FRAMESKIP_AUTO -1
+#define MAX_FRAMESKIP 9
+/* Frame requests: only frames asked for with request_frame() are drawn */
+#define FRAMES_ON_REQUEST 0
+
+/* Tile data occupies 0x8000 - 0x97FF, 384 tiles of 16 bytes each */
+#define TILE_DATA_SIZE 0x1800
+#define TILE_COUNT 384
+
+/* Sprite attribute flags */
+#define OBJ_BG_PRIORITY (1<<7)
+#define YFLIP (1<<6)
+#define XFLIP (1<<5)
+#define PALETTENR (1<<4)
+
 enum screen_status {
 	LCD_OFF = 1,
-	LCD_DRAWN = 2
+	LCD_DRAWN = 2,
+	LCD_VBLANK = 4,
+	LCD_FRAME = 8,
+	LCD_UNCHANGED = 16
+};
+
+struct scanline;
+
+/*
+ * A PPU backend draws the pixels of mode 3, video.c runs the mode, LY
+ * and interrupt timing around it. transfer() consumes dots from 'clock'
+ * and returns the length of mode 3 once the line is done.
+ */
+struct ppu_backend {
+	const char *name;
+	int frameskip;
+	void (*begin_line)(const struct scanline *sl);
+	int (*transfer)(int *clock);
+	int (*end_frame)(void);
+	const u8 *(*frame)(void);
 };
 
-int draw(u8 *screen);
+int set_ppu(const char *name);
+const char *ppu_name(void);
+int draw(void);
+const u8 *get_frame(void);
+void set_frameskip(int n);
+void set_target_speed(double speed);
+void set_frame_requests(int every);
+void request_frame(void);
+void pause_rendering(int paused);
+void frame_schedule_state(struct state *s);
+void draw_next_frame(void);
+void vram_written(u16 offset, u8 value);
+void video_state(struct state *s);
+void scanline_state(struct state *s);
 #endif
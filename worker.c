@@ -0,0 +1,237 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <pthread.h>
+#include <string.h>
+
+#include "gameboy.h"
+
+#include "memory.h"
+#include "record.h"
+#include "render.h"
+#include "video.h"
+#include "worker.h"
+
+#define DELTA_RING 0x10000
+#define LINE_RING 512
+
+#define LOAD(p) __atomic_load_n((p), __ATOMIC_SEQ_CST)
+#define STORE(p, v) __atomic_store_n((p), (v), __ATOMIC_SEQ_CST)
+
+/*
+ * Pipelined rendering. The emulation thread captures every line as a
+ * struct scanline and logs VRAM writes to a delta ring. Each line carries
+ * the delta ring position at the time it was captured, so the render
+ * thread applies exactly the writes that happened before it to its own
+ * copy of VRAM and draws the line as it looked at the end of mode 3.
+ *
+ * Both rings have a single producer (emulation) and a single consumer
+ * (render). The consumer sleeps while there are no lines, the producer
+ * only sleeps when a ring is full. Frames that were not skipped are
+ * recorded here as they are finished, the emulation thread only sees
+ * them later.
+ */
+struct line_entry {
+	struct scanline sl;
+	int frame_end;
+	int drawn;
+	u32 delta_pos;
+};
+
+static u32 deltas[DELTA_RING];
+static struct line_entry line_ring[LINE_RING];
+static u32 delta_head;
+static u32 delta_tail;
+static u32 line_head;
+static u32 line_tail;
+
+static u8 vram[0x2000];
+static u8 published[HEIGHT * WIDTH];
+
+static pthread_t thread;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t work = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t space = PTHREAD_COND_INITIALIZER;
+static int consumer_waiting;
+static int producer_waiting;
+static int running;
+static int quit;
+
+static void wake_producer(void)
+{
+	if (LOAD(&producer_waiting)) {
+		pthread_mutex_lock(&lock);
+		pthread_cond_signal(&space);
+		pthread_mutex_unlock(&lock);
+	}
+}
+
+static void wake_consumer(void)
+{
+	if (LOAD(&consumer_waiting)) {
+		pthread_mutex_lock(&lock);
+		pthread_cond_signal(&work);
+		pthread_mutex_unlock(&lock);
+	}
+}
+
+static void apply_deltas(u32 pos)
+{
+	u32 tail = delta_tail;
+	u32 d;
+
+	if (tail == pos)
+		return;
+
+	while (tail != pos) {
+		d = deltas[tail % DELTA_RING];
+		vram[d >> 8] = d & 0xFF;
+		render_vram_write(d >> 8);
+		tail++;
+	}
+	STORE(&delta_tail, tail);
+	wake_producer();
+}
+
+static void publish_frame(void)
+{
+	render_frame_done();
+
+	pthread_mutex_lock(&lock);
+	memcpy(published, render_frame(), sizeof(published));
+	pthread_mutex_unlock(&lock);
+}
+
+static void wait_for_work(void)
+{
+	pthread_mutex_lock(&lock);
+	STORE(&consumer_waiting, 1);
+	while (!LOAD(&quit) && LOAD(&line_tail) == LOAD(&line_head) &&
+	       !(LOAD(&producer_waiting) && LOAD(&delta_head) != delta_tail))
+		pthread_cond_wait(&work, &lock);
+	STORE(&consumer_waiting, 0);
+	pthread_mutex_unlock(&lock);
+}
+
+static void *render_main(void *arg)
+{
+	struct line_entry *e;
+	u32 head;
+
+	(void) arg;
+
+	/*
+	 * Deltas are never applied past the delta_pos of the next pending
+	 * line. With no line pending, only the deltas pushed before the check
+	 * are, as any line pushed after it carries a later position.
+	 */
+	for (;;) {
+		head = LOAD(&delta_head);
+		if (line_tail == LOAD(&line_head)) {
+			apply_deltas(head);
+			if (LOAD(&quit))
+				break;
+			wait_for_work();
+			continue;
+		}
+
+		e = &line_ring[line_tail % LINE_RING];
+		apply_deltas(e->delta_pos);
+		if (e->frame_end) {
+			publish_frame();
+			if (e->drawn)
+				record_frame(render_frame());
+		} else
+			render_line(&e->sl);
+
+		STORE(&line_tail, line_tail + 1);
+		wake_producer();
+	}
+	return NULL;
+}
+
+static void wait_for_space(u32 *tail, u32 head, u32 size)
+{
+	pthread_mutex_lock(&lock);
+	STORE(&producer_waiting, 1);
+	pthread_cond_signal(&work);
+	while (head - LOAD(tail) >= size)
+		pthread_cond_wait(&space, &lock);
+	STORE(&producer_waiting, 0);
+	pthread_mutex_unlock(&lock);
+}
+
+void worker_vram_write(u16 offset, u8 value)
+{
+	if (delta_head - LOAD(&delta_tail) >= DELTA_RING)
+		wait_for_space(&delta_tail, delta_head, DELTA_RING);
+
+	deltas[delta_head % DELTA_RING] = ((u32) offset << 8) | value;
+	STORE(&delta_head, delta_head + 1);
+}
+
+static void push_line(const struct scanline *sl, int frame_end, int drawn)
+{
+	struct line_entry *e;
+
+	if (line_head - LOAD(&line_tail) >= LINE_RING)
+		wait_for_space(&line_tail, line_head, LINE_RING);
+
+	e = &line_ring[line_head % LINE_RING];
+	if (sl)
+		e->sl = *sl;
+	e->frame_end = frame_end;
+	e->drawn = drawn;
+	e->delta_pos = delta_head;
+	STORE(&line_head, line_head + 1);
+	wake_consumer();
+}
+
+void worker_line(const struct scanline *sl)
+{
+	push_line(sl, 0, 1);
+}
+
+/* 'drawn' is cleared for skipped frames */
+void worker_frame_done(int drawn)
+{
+	push_line(NULL, 1, drawn);
+}
+
+/* Copy out the last frame the render thread finished */
+void worker_frame(u8 *dst)
+{
+	pthread_mutex_lock(&lock);
+	memcpy(dst, published, sizeof(published));
+	pthread_mutex_unlock(&lock);
+}
+
+int render_thread_running(void)
+{
+	return running;
+}
+
+void start_render_thread(void)
+{
+	memcpy(vram, get_vram(), sizeof(vram));
+	set_render_vram(vram);
+
+	if (pthread_create(&thread, NULL, render_main, NULL) != 0)
+		die("could not start render thread");
+	running = 1;
+}
+
+void stop_render_thread(void)
+{
+	if (!running)
+		return;
+
+	pthread_mutex_lock(&lock);
+	STORE(&quit, 1);
+	pthread_cond_signal(&work);
+	pthread_mutex_unlock(&lock);
+
+	pthread_join(thread, NULL);
+	running = 0;
+	quit = 0;
+	set_render_vram(get_vram());
+}
@@ -0,0 +1,18 @@
+#ifndef WORKER_H
+#define WORKER_H
+struct scanline;
+
+void start_render_thread(void);
+
+void stop_render_thread(void);
+
+int render_thread_running(void);
+
+void worker_vram_write(u16 offset, u8 value);
+
+void worker_line(const struct scanline *sl);
+
+void worker_frame_done(int drawn);
+
+void worker_frame(u8 *dst);
+#endif